@@ -0,0 +1,153 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Times the bisector cleaning of the LFS computation on the MAT of a synthetic point cloud. The neighbours
+// of the MA points are searched once and cached, so that the kernels are timed on their own: the one of
+// clean_ma_points, and a reference with an arccosine per neighbour and a serial bisector pass. The parallel
+// compaction of the kept MA points is compared with appending them one by one. The masks can differ for
+// bisector angles within rounding of the threshold, where the arccosine of a float is least accurate.
+// Cleaning again with the bisector angles that clean_ma_points keeps in madata is timed as well.
+//
+//   bench_cleaning [number of points] [bisector threshold in degrees] [k]
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#include "compute_ma_processing.h"
+#include "compute_normals_processing.h"
+#include "parallel.h"
+#include "simplify_processing.h"
+#include "synthetic.h"
+#include "types.h"
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// The cleaning kernel as it was: serial bisectors, and the angles compared with std::acos
+size_t reference_cleaning(const ma_data &madata, size_t N, double bisec_threshold, std::vector<char> &bisec_mask) {
+   Vector3List ma_bisec(N);
+   for (size_t i = 0; i < N; i++)
+      if (madata.ma_qidx[i] != -1) {
+         Vector3 f1 = (*madata.coords)[i % madata.coords->size()] - (*madata.ma_coords)[i];
+         Vector3 f2 = (*madata.coords)[madata.ma_qidx[i]] - (*madata.ma_coords)[i];
+         ma_bisec[i] = (f1 + f2).normalized();
+      }
+
+   const neighbour_graph &graph = *madata.ma_knn;
+   bisec_mask.assign(N, false);
+   long long count = 0;
+#pragma omp parallel for schedule(dynamic, dynamic_chunk_size) reduction(+:count)
+   for (long long i = 0; i < (long long)N; i++) {
+      if (madata.ma_qidx[i] == -1)
+         continue;
+      float max_bisec_angle = 0;
+      for (int j = 1; j < graph.count(i); j++) {
+         int n = graph.neighbours(i)[j];
+         if (madata.ma_qidx[n] == -1)
+            continue;
+         float bisec_angle = std::acos(ma_bisec[n].dot(ma_bisec[i]));
+         if (bisec_angle > max_bisec_angle)
+            max_bisec_angle = bisec_angle;
+      }
+      if (max_bisec_angle < bisec_threshold) {
+         bisec_mask[i] = true;
+         count++;
+      }
+   }
+   return size_t(count);
+}
+
+int main(int argc, char **argv) {
+   size_t n_points = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 1000000;
+   double threshold = (argc > 2 ? std::atof(argv[2]) : 2) / 180 * M_PI;
+   int k = argc > 3 ? std::atoi(argv[3]) : 4;
+   const int repeats = 5;
+
+   ma_data madata = {};
+   madata.coords = make_cloud(n_points);
+   madata.normals.reset(new point_array(n_points));
+   normals_parameters normals_params;
+   normals_params.k = 10;
+   compute_normals(normals_params, madata);
+   madata.ma_coords.reset(new point_array(2 * n_points));
+   madata.ma_qidx.resize(2 * n_points);
+   madata.ma_radius.resize(2 * n_points);
+   ma_parameters ma_params = {};
+   ma_params.initial_radius = 200;
+   ma_params.denoise_preserve = 20.0 / 180 * M_PI;
+   ma_params.denoise_planar = 32.0 / 180 * M_PI;
+   compute_masb_points(ma_params, madata);
+   size_t N = 2 * n_points;
+
+   // search the neighbours once
+   madata.ma_knn.reset(new neighbour_graph);
+   std::vector<char> mask, reference_mask;
+   auto start_time = Clock::now();
+   clean_ma_points(madata, N, threshold, k, mask);
+   double search_time = std::chrono::duration<double>(Clock::now() - start_time).count();
+   std::cout << "MA points: " << N << ", k: " << k << ", cleaning with kd-tree search: " << search_time << " s" << std::endl;
+
+   double kernel_time = 0, reference_time = 0, cached_time = 0;
+   size_t kept = 0, reference_kept = 0;
+   for (int r = 0; r < repeats; r++) {
+      // without the cached bisector angles, so that they are computed again
+      madata.ma_bisec_cos.clear();
+      start_time = Clock::now();
+      kept = clean_ma_points(madata, N, threshold, k, mask);
+      kernel_time += std::chrono::duration<double>(Clock::now() - start_time).count() / repeats;
+      start_time = Clock::now();
+      clean_ma_points(madata, N, threshold / 2, k, reference_mask);
+      cached_time += std::chrono::duration<double>(Clock::now() - start_time).count() / repeats;
+      start_time = Clock::now();
+      reference_kept = reference_cleaning(madata, N, threshold, reference_mask);
+      reference_time += std::chrono::duration<double>(Clock::now() - start_time).count() / repeats;
+   }
+   size_t differ = 0;
+   for (size_t i = 0; i < N; i++)
+      differ += mask[i] != reference_mask[i];
+
+   double compaction_time = 0, append_time = 0;
+   for (int r = 0; r < repeats; r++) {
+      start_time = Clock::now();
+      point_array compacted(kept);
+      parallel_scan(N, [&mask](size_t i) { return int64_t(mask[i]); }, [&](size_t i, int64_t rank) {
+         if (mask[i])
+            compacted.set(rank, madata.ma_coords->x[i], madata.ma_coords->y[i], madata.ma_coords->z[i]);
+      });
+      compaction_time += std::chrono::duration<double>(Clock::now() - start_time).count() / repeats;
+      start_time = Clock::now();
+      point_array appended;
+      appended.reserve(kept);
+      for (size_t i = 0; i < N; i++)
+         if (mask[i])
+            appended.push_back(madata.ma_coords->x[i], madata.ma_coords->y[i], madata.ma_coords->z[i]);
+      append_time += std::chrono::duration<double>(Clock::now() - start_time).count() / repeats;
+   }
+
+   std::cout << "cleaning:    " << kernel_time * 1000 << " ms, " << N / kernel_time << " MA points/s, " << kept << " kept" << std::endl;
+   std::cout << "reference:   " << reference_time * 1000 << " ms, " << N / reference_time << " MA points/s, " << reference_kept << " kept" << std::endl;
+   std::cout << "cached angles, half the threshold: " << cached_time * 1000 << " ms" << std::endl;
+   std::cout << "Speedup: " << reference_time / kernel_time << "x, masks differ for " << differ << " MA points" << std::endl;
+   std::cout << "compaction:  " << compaction_time * 1000 << " ms, appending: " << append_time * 1000 << " ms" << std::endl;
+   return 0;
+}
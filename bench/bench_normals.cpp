@@ -0,0 +1,128 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Compares normal estimation with pcl::NormalEstimationOMP against the built-in estimator, for the
+// same number of neighbours. Both timings include building the kd-tree. The normals of both are also
+// compared with a double-precision eigensolve of the same neighbourhoods. The scan lines dataset has nearly
+// collinear neighbourhoods, where float solvers are least accurate.
+//
+//   bench_normals [number of points] [k] [dataset: spheres or scanlines]
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <Eigen/Eigenvalues>
+
+#include <pcl/features/normal_3d_omp.h>
+
+#include "compute_normals_processing.h"
+#include "kdtree.h"
+#include "nn_search.h"
+#include "synthetic.h"
+#include "types.h"
+
+typedef std::chrono::high_resolution_clock Clock;
+
+int main(int argc, char **argv) {
+   size_t n_points = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 1000000;
+   int k = argc > 2 ? std::atoi(argv[2]) : 10;
+   std::string dataset = argc > 3 ? argv[3] : "spheres";
+   if (dataset != "spheres" && dataset != "scanlines") {
+      std::cerr << "Unknown dataset " << dataset << std::endl;
+      return 1;
+   }
+
+   point_array::Ptr cloud = dataset == "scanlines" ? make_scanlines(n_points) : make_cloud(n_points);
+   std::cout << "Points: " << n_points << " (" << dataset << "), k: " << k << std::endl;
+
+   auto start_time = Clock::now();
+   pcl_search search(cloud);
+   pcl::NormalEstimationOMP<Point, Normal> estimation;
+   estimation.setInputCloud(search.pcl_cloud());
+   estimation.setSearchMethod(search.tree());
+   estimation.setKSearch(k + 1);
+   NormalCloud pcl_normals;
+   estimation.compute(pcl_normals);
+   point_array reference;
+   from_pcl_normals(pcl_normals, reference);
+   double pcl_time = std::chrono::duration<double>(Clock::now() - start_time).count();
+
+   start_time = Clock::now();
+   ma_data madata = {};
+   madata.coords = cloud;
+   normals_parameters params;
+   params.k = k;
+   compute_normals(params, madata);
+   double native_time = std::chrono::duration<double>(Clock::now() - start_time).count();
+
+   // Both orient the normals towards the origin, so the normals should point the same way
+   double sum_dot = 0;
+   size_t deviating = 0, flipped = 0;
+   for (size_t i = 0; i < n_points; i++) {
+      Scalar dot = reference[i].dot((*madata.normals)[i]);
+      sum_dot += std::abs(dot);
+      if (std::abs(dot) < 0.99f)
+         deviating++;
+      if (dot < 0)
+         flipped++;
+   }
+
+   std::cout << "pcl:    " << pcl_time << " s, " << n_points / pcl_time << " points/s" << std::endl;
+   std::cout << "native: " << native_time << " s, " << n_points / native_time << " points/s" << std::endl;
+   std::cout << "Speedup: " << pcl_time / native_time << "x" << std::endl;
+   std::cout << "Mean |cos| between the normals: " << sum_dot / n_points << ", deviating by more than 8 degrees: " << deviating << ", opposite orientation: " << flipped << std::endl;
+
+   // The largest angle of both with the eigenvector of a double-precision solve of the same neighbourhood
+   kdtree kd_tree(cloud);
+   std::vector<int> indices(k + 1);
+   std::vector<Scalar> sqdists(k + 1);
+   double pcl_max = 0, native_max = 0;
+   size_t pcl_over = 0, native_over = 0;
+   for (size_t i = 0; i < n_points; i++) {
+      int found = kd_tree.nearest_k((*cloud)[i], k + 1, indices.data(), sqdists.data());
+      if (found < 3)
+         continue;
+      Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+      for (int j = 0; j < found; j++)
+         mean += (*cloud)[indices[j]].transpose().cast<double>();
+      mean /= found;
+      Eigen::Matrix3d covariance = Eigen::Matrix3d::Zero();
+      for (int j = 0; j < found; j++) {
+         Eigen::Vector3d d = (*cloud)[indices[j]].transpose().cast<double>() - mean;
+         covariance += d * d.transpose();
+      }
+      Eigen::Vector3d exact = Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d>(covariance).eigenvectors().col(0);
+      double pcl_angle = std::acos(std::min(1.0, std::abs(exact.dot(reference[i].transpose().cast<double>())))) * 180 / M_PI;
+      double native_angle = std::acos(std::min(1.0, std::abs(exact.dot((*madata.normals)[i].transpose().cast<double>())))) * 180 / M_PI;
+      // NaN normals (coinciding neighbours) fail both comparisons
+      if (pcl_angle > pcl_max) pcl_max = pcl_angle;
+      if (native_angle > native_max) native_max = native_angle;
+      pcl_over += pcl_angle > 1;
+      native_over += native_angle > 1;
+   }
+   std::cout << "Largest angle with a double-precision solve: pcl " << pcl_max << " degrees (" << pcl_over << " over 1 degree), native "
+      << native_max << " degrees (" << native_over << " over 1 degree)" << std::endl;
+   return 0;
+}
@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Compares 1-NN query throughput of the built-in kd-tree against the PCL (FLANN) kd-tree.
+//
+//   bench_search [number of points] [number of queries]
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "kdtree.h"
+#include "nn_search.h"
+#include "synthetic.h"
+#include "types.h"
+
+typedef std::chrono::high_resolution_clock Clock;
+
+std::vector<Vector3> make_queries(const point_array &cloud, size_t n) {
+   std::mt19937 gen(7);
+   std::uniform_int_distribution<size_t> randi(0, cloud.size() - 1);
+   std::normal_distribution<float> randn(0, 5);
+   std::vector<Vector3> queries(n);
+   for (size_t i = 0; i < n; i++)
+      queries[i] = cloud[randi(gen)] + Vector3(randn(gen), randn(gen), randn(gen));
+   return queries;
+}
+
+double run_queries(const nn_search &search, const std::vector<Vector3> &queries, std::vector<Scalar> &sqdists) {
+   auto start_time = Clock::now();
+#pragma omp parallel for
+   for (int i = 0; i < int(queries.size()); i++)
+      search.nearest(queries[i], sqdists[i]);
+   return std::chrono::duration<double>(Clock::now() - start_time).count();
+}
+
+int main(int argc, char **argv) {
+   size_t n_points = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 10000000;
+   size_t n_queries = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 10000000;
+
+   point_array::Ptr cloud = make_cloud(n_points);
+   std::vector<Vector3> queries = make_queries(*cloud, n_queries);
+   std::cout << "Points: " << n_points << ", queries: " << n_queries << std::endl;
+
+   auto start_time = Clock::now();
+   kdtree kd(cloud);
+   double kd_build = std::chrono::duration<double>(Clock::now() - start_time).count();
+
+   start_time = Clock::now();
+   pcl_search pcl(cloud);
+   double pcl_build = std::chrono::duration<double>(Clock::now() - start_time).count();
+
+   std::vector<Scalar> kd_sqdists(n_queries), pcl_sqdists(n_queries);
+   double kd_time = run_queries(kd, queries, kd_sqdists);
+   double pcl_time = run_queries(pcl, queries, pcl_sqdists);
+
+   size_t mismatches = 0;
+   for (size_t i = 0; i < n_queries; i++)
+      if (kd_sqdists[i] != pcl_sqdists[i])
+         mismatches++;
+
+   std::cout << "kdtree: build " << kd_build << " s, " << n_queries / kd_time << " queries/s" << std::endl;
+   std::cout << "pcl:    build " << pcl_build << " s, " << n_queries / pcl_time << " queries/s" << std::endl;
+   std::cout << "Speedup: " << pcl_time / kd_time << "x, mismatching distances: " << mismatches << std::endl;
+   return 0;
+}
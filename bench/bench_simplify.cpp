@@ -0,0 +1,87 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Times the grid simplification of simplify on sparse airborne data, where most cells of the grid over the
+// bounding box are empty, for a range of cellsizes. The lfs values are synthetic, so only the grid is timed.
+//
+//   bench_simplify [number of points] [smallest cellsize]
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include "madata.h"
+#include "simplify_processing.h"
+#include "synthetic.h"
+#include "types.h"
+
+typedef std::chrono::high_resolution_clock Clock;
+
+int main(int argc, char **argv) {
+   size_t n_points = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 10000000;
+   double min_cellsize = argc > 2 ? std::atof(argv[2]) : 0.1;
+
+   ma_data madata = {};
+   madata.coords = make_airborne(n_points);
+   madata.lfs.resize(n_points);
+   madata.mask.resize(n_points);
+   std::mt19937 gen(42);
+   std::uniform_real_distribution<float> randu(1, 10);
+   for (size_t i = 0; i < n_points; i++)
+      madata.lfs[i] = randu(gen);
+
+   Vector3 min_pt = (*madata.coords)[0], max_pt = min_pt;
+   for (size_t i = 1; i < n_points; i++) {
+      min_pt = min_pt.cwiseMin((*madata.coords)[i]);
+      max_pt = max_pt.cwiseMax((*madata.coords)[i]);
+   }
+   Vector3 size = max_pt - min_pt;
+   std::cout << "Points: " << n_points << ", extent " << size[0] << " x " << size[1] << " x " << size[2] << std::endl;
+
+   simplify_parameters params = {};
+   params.epsilon = 0.4;
+   params.compute_lfs = false;
+   for (int true_z = 1; true_z >= 0; true_z--)
+      for (double cellsize = 10; cellsize >= min_cellsize * 0.999; cellsize /= 10) {
+         params.cellsize = cellsize;
+         params.true_z_dim = true_z;
+         params.elevation_threshold = true_z ? 0 : 0.5;
+
+         // the number of cells of a dense grid, which is what the cells would have cost before
+         double dense = (std::floor(size[0] / cellsize) + 1) * (std::floor(size[1] / cellsize) + 1);
+         if (true_z)
+            dense *= std::floor(size[2] / cellsize) + 1;
+
+         auto start_time = Clock::now();
+         simplify_lfs(params, madata);
+         double time = std::chrono::duration<double>(Clock::now() - start_time).count();
+
+         size_t kept = 0;
+         for (size_t i = 0; i < n_points; i++)
+            kept += madata.mask[i];
+         std::cout << (true_z ? "3D" : "2D") << " cellsize " << cellsize << ": " << time << " s, " << n_points / time
+            << " points/s, " << kept << " points kept, dense grid of " << dense << " cells" << std::endl;
+      }
+   return 0;
+}
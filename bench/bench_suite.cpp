@@ -0,0 +1,218 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Times the stages of the pipeline separately on deterministic synthetic point clouds, and writes the
+// results as JSON, to compare releases and machines. For every dataset and size the points are generated,
+// and then timed in turn: compute_normals, compute_masb_points, compute_lfs, the grid simplification of
+// simplify_lfs, and writing and reading all arrays with madata2npy and npy2madata. Every stage reports
+// points per second and the peak resident set size; the MAT stage also the average number of shrinking
+// iterations per ball. The sphere is not among the default datasets, its MAT takes quadratic time.
+//
+//   bench_suite [-n 1000000,10000000,50000000] [-d torus,plane,city,terrain] [-j bench_suite.json] [--io .]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <tclap/CmdLine.h>
+
+#include "compute_ma_processing.h"
+#include "compute_normals_processing.h"
+#include "io.h"
+#include "parallel.h"
+#include "simplify_processing.h"
+#include "stats.h"
+#include "synthetic.h"
+#include "types.h"
+#include "version.h"
+
+typedef std::chrono::high_resolution_clock Clock;
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+// Start measuring the peak resident set size of a stage. Only Linux can reset the peak of a process; on
+// other systems the peaks are those of the process so far.
+void reset_peak_rss() {
+#ifdef __linux__
+   std::ofstream clear_refs("/proc/self/clear_refs");
+   clear_refs << "5";
+#endif
+}
+
+std::vector<std::string> split(const std::string &list) {
+   std::vector<std::string> items;
+   std::stringstream ss(list);
+   std::string item;
+   while (std::getline(ss, item, ','))
+      if (!item.empty())
+         items.push_back(item);
+   return items;
+}
+
+struct stage_result {
+   std::string dataset;
+   size_t points;
+   std::string stage;
+   double seconds;
+   size_t peak_rss;
+   double iterations; // average number of shrinking iterations per ball, 0 for the other stages
+};
+
+stage_result run_stage(const std::string &dataset, size_t points, const std::string &stage, std::function<void()> run) {
+   reset_peak_rss();
+   auto start_time = Clock::now();
+   run();
+   stage_result result = {dataset, points, stage, std::chrono::duration<double>(Clock::now() - start_time).count(), peak_rss(), 0};
+   std::cout << dataset << " " << points << " " << stage << ": " << result.seconds << " s, " << points / result.seconds
+      << " points/s, peak RSS " << result.peak_rss / (1024 * 1024) << " MiB" << std::endl;
+   return result;
+}
+
+void write_json(std::string path, const std::vector<stage_result> &results) {
+   std::ofstream out(path);
+   if (!out) {
+      std::cerr << "Invalid file path " << path << std::endl;
+      exit(1);
+   }
+   out.precision(9);
+   out << "{\n  \"version\": \"" << TO_STRING(MASBCPP_VERSION) << "\",\n  \"threads\": " << thread_count() << ",\n  \"results\": [";
+   for (size_t i = 0; i < results.size(); i++) {
+      const stage_result &r = results[i];
+      out << (i ? ",\n" : "\n") << "    {\"dataset\": \"" << r.dataset << "\", \"points\": " << r.points
+          << ", \"stage\": \"" << r.stage << "\", \"seconds\": " << r.seconds
+          << ", \"points_per_second\": " << r.points / r.seconds << ", \"peak_rss_bytes\": " << r.peak_rss;
+      if (r.stage == "ma")
+         out << ", \"average_iterations\": " << r.iterations;
+      out << "}";
+   }
+   out << "\n  ]\n}\n";
+}
+
+int main(int argc, char **argv) {
+   std::vector<std::string> sizes, datasets;
+   std::string json_path, io_path;
+   try {
+      TCLAP::CmdLine cmd("Times the stages of masbcpp on synthetic point clouds", ' ', "0.1");
+      TCLAP::ValueArg<std::string> sizesArg("n", "sizes", "Comma separated numbers of points.", false, "1000000,10000000,50000000", "list", cmd);
+      TCLAP::ValueArg<std::string> datasetsArg("d", "datasets", "Comma separated datasets, out of sphere (the worst case, in quadratic time), torus, plane (noisy), city (boxes) and terrain (2.5D with walls).", false, "torus,plane,city,terrain", "list", cmd);
+      TCLAP::ValueArg<std::string> jsonArg("j", "json", "File to write the results to.", false, "bench_suite.json", "file", cmd);
+      TCLAP::ValueArg<std::string> ioArg("", "io", "Directory in which the directory 'bench_suite_io' is created, for the .npy files of the I/O stages.", false, ".", "dir", cmd);
+      cmd.parse(argc, argv);
+      sizes = split(sizesArg.getValue());
+      datasets = split(datasetsArg.getValue());
+      json_path = jsonArg.getValue();
+      io_path = ioArg.getValue() + "/bench_suite_io";
+   } catch (TCLAP::ArgException &e) {
+      std::cerr << "Error: " << e.error() << " for " << e.argId() << std::endl;
+      return 1;
+   }
+
+   std::vector<std::pair<std::string, std::function<point_array::Ptr(size_t)> > > generators = {
+      {"sphere", make_sphere}, {"torus", make_torus}, {"plane", make_noisy_plane}, {"city", make_box_city}, {"terrain", make_terrain}};
+#ifdef _WIN32
+   _mkdir(io_path.c_str());
+#else
+   mkdir(io_path.c_str(), 0755);
+#endif
+
+   std::vector<stage_result> results;
+   for (const std::string &dataset : datasets) {
+      std::function<point_array::Ptr(size_t)> generate;
+      for (auto &g : generators)
+         if (g.first == dataset)
+            generate = g.second;
+      if (!generate) {
+         std::cerr << "Unknown dataset " << dataset << std::endl;
+         return 1;
+      }
+
+      for (const std::string &size : sizes) {
+         size_t n = std::strtoul(size.c_str(), NULL, 10);
+         ma_data madata = {};
+         madata.coords = generate(n);
+
+         results.push_back(run_stage(dataset, n, "normals", [&]() {
+            normals_parameters params;
+            params.k = 10;
+            compute_normals(params, madata);
+         }));
+
+         size_t iterations = 0;
+         results.push_back(run_stage(dataset, n, "ma", [&]() {
+            ma_parameters params = {};
+            params.initial_radius = 200;
+            params.denoise_preserve = 20.0 / 180 * M_PI;
+            params.denoise_planar = 32.0 / 180 * M_PI;
+            madata.ma_coords.reset(new point_array(2 * n));
+            madata.ma_qidx.resize(2 * n);
+            madata.ma_radius.resize(2 * n);
+            iterations = compute_masb_points(params, madata);
+         }));
+         results.back().iterations = double(iterations) / (2 * n);
+
+         results.push_back(run_stage(dataset, n, "lfs", [&]() {
+            madata.lfs.resize(n);
+            compute_lfs(madata, 2.0 / 180 * M_PI, 4, false);
+         }));
+
+         results.push_back(run_stage(dataset, n, "simplify", [&]() {
+            simplify_parameters params = {};
+            params.epsilon = 0.4;
+            params.cellsize = 0.5;
+            params.true_z_dim = true;
+            params.compute_lfs = false;
+            madata.mask.resize(n);
+            simplify_lfs(params, madata);
+         }));
+
+         io_parameters io_params = {};
+         io_params.coords = io_params.normals = io_params.ma_coords = io_params.ma_qidx = io_params.lfs = true;
+         results.push_back(run_stage(dataset, n, "write", [&]() {
+            io_parameters write_params = io_params;
+            write_params.ma_radius = write_params.mask = true;
+            madata2npy(io_path, madata, write_params);
+         }));
+         results.push_back(run_stage(dataset, n, "read", [&]() {
+            ma_data read = {};
+            npy2madata(io_path, read, io_params);
+         }));
+      }
+   }
+
+   write_json(json_path, results);
+   std::cout << "Results written to " << json_path << std::endl;
+   return 0;
+}
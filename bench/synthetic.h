@@ -0,0 +1,233 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_BENCH_SYNTHETIC_
+#define MASBCPP_BENCH_SYNTHETIC_
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "point_array.h"
+#include "types.h"
+
+// Points sampled on a set of randomly placed spheres, a crude stand-in for a scanned surface
+inline point_array::Ptr make_cloud(size_t n) {
+   std::mt19937 gen(42);
+   std::uniform_real_distribution<float> randu(0, 1);
+   std::vector<Vector3> centers(64);
+   std::vector<float> radii(centers.size());
+   for (size_t i = 0; i < centers.size(); i++) {
+      centers[i] = Vector3(1000 * randu(gen), 1000 * randu(gen), 100 * randu(gen));
+      radii[i] = 10 + 40 * randu(gen);
+   }
+
+   point_array::Ptr cloud(new point_array(n));
+   for (size_t i = 0; i < n; i++) {
+      size_t s = i % centers.size();
+      float z = 2 * randu(gen) - 1, t = float(2 * M_PI) * randu(gen), r = std::sqrt(1 - z * z);
+      cloud->set(i, centers[s] + radii[s] * Vector3(r * std::cos(t), r * std::sin(t), z));
+   }
+   return cloud;
+}
+
+// An airborne scan of a 10 x 10 km area: flight strips of 400 m wide along x, 1 km apart, so that most
+// of the columns of a grid over the area are empty. The strips cover rolling terrain with buildings (flat
+// roofs up to 40 m high, in 30% of the blocks of 100 x 100 m) and lakes without returns.
+inline point_array::Ptr make_airborne(size_t n) {
+   std::mt19937 gen(42);
+   std::uniform_real_distribution<float> randu(0, 1);
+   const float extent = 10000, strip_width = 400, strip_spacing = 1000;
+
+   // at most one building in every block of 100 x 100 m
+   const int blocks = int(extent / 100);
+   struct box { float x0, y0, x1, y1, z; };
+   std::vector<box> buildings(blocks * blocks);
+   for (int b = 0; b < blocks * blocks; b++) {
+      float x = 100 * (b % blocks) + 10 + 30 * randu(gen), y = 100 * (b / blocks) + 10 + 30 * randu(gen);
+      float height = randu(gen) < 0.3f ? 10 + 30 * randu(gen) : 0;
+      buildings[b] = box{x, y, x + 20 + 40 * randu(gen), y + 20 + 40 * randu(gen), height};
+   }
+   std::vector<Vector3> lakes(20); // center and radius
+   for (Vector3 &l : lakes)
+      l = Vector3(extent * randu(gen), extent * randu(gen), 100 + 300 * randu(gen));
+
+   point_array::Ptr cloud(new point_array(n));
+   for (size_t i = 0; i < n; i++) {
+      float x, y;
+      bool water;
+      do {
+         x = extent * randu(gen);
+         y = float(int(10 * randu(gen))) * strip_spacing + strip_width * randu(gen);
+         water = false;
+         for (const Vector3 &l : lakes)
+            water = water || (x - l[0]) * (x - l[0]) + (y - l[1]) * (y - l[1]) < l[2] * l[2];
+      } while (water);
+      float z = 50 * std::sin(x / 1500) * std::cos(y / 1100);
+      const box &b = buildings[std::min(int(y / 100), blocks - 1) * blocks + std::min(int(x / 100), blocks - 1)];
+      if (x >= b.x0 && x < b.x1 && y >= b.y0 && y < b.y1)
+         z += b.z;
+      cloud->set(i, x, y, z);
+   }
+   return cloud;
+}
+
+// A sphere with a radius of 100 around the origin, sampled uniformly. This is the worst case of the shrinking
+// ball algorithm: all interior balls end at the center, where every point is at the same distance, so that
+// the nearest neighbour queries cannot prune and the MAT takes quadratic time.
+inline point_array::Ptr make_sphere(size_t n) {
+   std::mt19937 gen(42);
+   std::uniform_real_distribution<float> randu(0, 1);
+   point_array::Ptr cloud(new point_array(n));
+   for (size_t i = 0; i < n; i++) {
+      float z = 2 * randu(gen) - 1, t = float(2 * M_PI) * randu(gen), r = std::sqrt(1 - z * z);
+      cloud->set(i, 100 * r * std::cos(t), 100 * r * std::sin(t), 100 * z);
+   }
+   return cloud;
+}
+
+// A torus around the z axis with radii 100 and 30, sampled uniformly: the angle around the tube is
+// rejected in proportion to the distance to the axis. Its interior medial axis is a circle.
+inline point_array::Ptr make_torus(size_t n) {
+   std::mt19937 gen(42);
+   std::uniform_real_distribution<float> randu(0, 1);
+   const float R = 100, r = 30;
+   point_array::Ptr cloud(new point_array(n));
+   for (size_t i = 0; i < n; i++) {
+      float u = float(2 * M_PI) * randu(gen), v;
+      do
+         v = float(2 * M_PI) * randu(gen);
+      while ((R + r) * randu(gen) > R + r * std::cos(v));
+      float d = R + r * std::cos(v);
+      cloud->set(i, d * std::cos(u), d * std::sin(u), r * std::sin(v));
+   }
+   return cloud;
+}
+
+// A 1 x 1 km plane with normally distributed noise of 5 cm, so that the balls are shrunk by the noise
+inline point_array::Ptr make_noisy_plane(size_t n) {
+   std::mt19937 gen(42);
+   std::uniform_real_distribution<float> randu(0, 1000);
+   std::normal_distribution<float> noise(0, 0.05f);
+   point_array::Ptr cloud(new point_array(n));
+   for (size_t i = 0; i < n; i++) {
+      float x = randu(gen), y = randu(gen);
+      cloud->set(i, x, y, noise(gen));
+   }
+   return cloud;
+}
+
+// A 1 x 1 km city of box shaped buildings on flat ground, one in every block of 100 x 100 m, with
+// footprints of 20 to 60 m and heights of 10 to 80 m. The ground, the roofs and the walls are sampled
+// uniformly by area, like a terrestrial or oblique scan that sees all sides of the buildings.
+inline point_array::Ptr make_box_city(size_t n) {
+   std::mt19937 gen(42);
+   std::uniform_real_distribution<float> randu(0, 1);
+   struct box { float x0, y0, x1, y1, z; };
+   std::vector<box> buildings(100);
+   std::vector<double> area(1 + buildings.size()); // cumulative: the ground, then the buildings
+   area[0] = 1000 * 1000;
+   for (size_t b = 0; b < buildings.size(); b++) {
+      float x = 100 * (b % 10) + 10 + 30 * randu(gen), y = 100 * (b / 10) + 10 + 30 * randu(gen);
+      box bx = {x, y, x + 20 + 40 * randu(gen), y + 20 + 40 * randu(gen), 10 + 70 * randu(gen)};
+      buildings[b] = bx;
+      float w = bx.x1 - bx.x0, d = bx.y1 - bx.y0;
+      area[b + 1] = area[b] + w * d + 2 * (w + d) * bx.z;
+   }
+
+   point_array::Ptr cloud(new point_array(n));
+   for (size_t i = 0; i < n; i++) {
+      size_t s = std::upper_bound(area.begin(), area.end(), area.back() * randu(gen)) - area.begin();
+      if (s == 0 || s > buildings.size()) {
+         // the ground, except below the buildings
+         float x, y;
+         bool inside;
+         do {
+            x = 1000 * randu(gen);
+            y = 1000 * randu(gen);
+            const box &b = buildings[std::min(int(y / 100), 9) * 10 + std::min(int(x / 100), 9)];
+            inside = x >= b.x0 && x < b.x1 && y >= b.y0 && y < b.y1;
+         } while (inside);
+         cloud->set(i, x, y, 0);
+         continue;
+      }
+      const box &b = buildings[s - 1];
+      float w = b.x1 - b.x0, d = b.y1 - b.y0;
+      float a = (w * d + 2 * (w + d) * b.z) * randu(gen);
+      if (a < w * d) {
+         cloud->set(i, b.x0 + w * randu(gen), b.y0 + d * randu(gen), b.z);
+         continue;
+      }
+      // the walls, unrolled along the perimeter
+      float t = 2 * (w + d) * randu(gen), z = b.z * randu(gen);
+      if (t < w)
+         cloud->set(i, b.x0 + t, b.y0, z);
+      else if (t < w + d)
+         cloud->set(i, b.x1, b.y0 + t - w, z);
+      else if (t < 2 * w + d)
+         cloud->set(i, b.x1 - (t - w - d), b.y1, z);
+      else
+         cloud->set(i, b.x0, b.y1 - (t - 2 * w - d), z);
+   }
+   return cloud;
+}
+
+// A 2.5D terrain of 1 x 1 km: rolling hills with terraces that end in vertical steps of 5 m, where 10% of
+// the points are on the walls of the steps (as if scanned from the side). The rest is a height field.
+inline point_array::Ptr make_terrain(size_t n) {
+   std::mt19937 gen(42);
+   std::uniform_real_distribution<float> randu(0, 1);
+   auto hills = [](float x, float y) { return 30 * std::sin(x / 170) * std::cos(y / 130) + 10 * std::sin((x + y) / 60); };
+   const float step = 5;
+   point_array::Ptr cloud(new point_array(n));
+   for (size_t i = 0; i < n; i++) {
+      float x = 1000 * randu(gen), y = 1000 * randu(gen);
+      if (randu(gen) >= 0.1f) {
+         cloud->set(i, x, y, step * std::floor(hills(x, y) / step));
+         continue;
+      }
+      // a wall point: march along x to the next terrace edge, and sample the step there
+      float level = std::floor(hills(x, y) / step);
+      float x1 = x;
+      while (x1 < 1000 && std::floor(hills(x1, y) / step) == level)
+         x1 += 0.5f;
+      float other = std::floor(hills(std::min(x1, 1000.0f), y) / step);
+      float z0 = step * std::min(level, other), z1 = step * std::max(level, other);
+      cloud->set(i, x1, y, z0 + (z1 - z0) * randu(gen));
+   }
+   return cloud;
+}
+
+// Scan lines of 100 m along x, 1 m apart, with points every 1 cm and 0.1 mm of noise, as from a profile scanner
+// with a fine along-line and a coarse across-line spacing. The k nearest neighbours of a point all lie on its line,
+// so its two smallest covariance eigenvalues are nearly equal and the normal is ill-conditioned.
+inline point_array::Ptr make_scanlines(size_t n) {
+   std::mt19937 gen(42);
+   std::normal_distribution<float> noise(0, 1e-4f);
+   point_array::Ptr cloud(new point_array(n));
+   for (size_t i = 0; i < n; i++)
+      cloud->set(i, 0.01f * (i % 10000) + noise(gen), float(i / 10000) + noise(gen), noise(gen));
+   return cloud;
+}
+
+#endif
@@ -29,6 +29,8 @@ SOFTWARE.
 #include "compute_ma_processing.h"
 #include "io.h"
 #include "madata.h"
+#include "stats.h"
+#include "tiled_processing.h"
 #include "types.h"
 
 int main(int argc, char **argv) {
@@ -42,8 +44,20 @@ int main(int argc, char **argv) {
       TCLAP::ValueArg<double> denoise_preserveArg("d", "preserve", "denoise preserve threshold", false, 20, "double", cmd);
       TCLAP::ValueArg<double> denoise_planarArg("p", "planar", "denoise planar threshold", false, 32, "double", cmd);
       TCLAP::ValueArg<double> initial_radiusArg("r", "radius", "initial ball radius", false, 200, "double", cmd);
+      TCLAP::SwitchArg estimate_radiusSwitch("", "estimate-radius", "also estimate an initial radius for each of 4x4 regions of the bounding box, with a pilot run on 4096 points, and report it with the iterations and the number of pilot balls that would change compared to -r; the MAT is still computed from -r", cmd, false);
 
       TCLAP::SwitchArg nan_for_initrSwitch("a", "nan", "write nan for points with radius equal to initial radius", cmd, false);
+      TCLAP::SwitchArg packetSwitch("k", "packet", "use the packet kernel that advances several balls in lockstep with SIMD instructions", cmd, false);
+      TCLAP::SwitchArg verify_packetSwitch("", "verify-packet", "compute the MAT with both the scalar and the packet kernel (without warm start) and check that the results are bit-for-bit equal", cmd, false);
+      TCLAP::SwitchArg sortSwitch("", "sort", "sort the points along a Morton curve before processing, for better cache locality; the output is written in input order", cmd, false);
+      TCLAP::SwitchArg warm_startSwitch("w", "warm", "warm start: process points in spatially coherent order and start each ball from the radius of a neighbouring ball instead of the initial radius", cmd, false);
+
+      TCLAP::ValueArg<double> memoryArg("m", "memory", "memory budget in MB; if set the input is processed out-of-core in tiles that fit in this budget", false, 0, "double", cmd);
+      TCLAP::ValueArg<double> haloArg("", "halo", "width of the halo around each tile in tiled mode, defaults to twice the initial radius", false, 0, "double", cmd);
+      TCLAP::SwitchArg verify_tiledSwitch("", "verify-tiled", "in tiled mode, also compute the MAT in-core (warm start and sorting are turned off for both) and check that the results are bit-for-bit equal", cmd, false);
+      TCLAP::ValueArg<int> tile_normalsArg("", "tile-normals", "in tiled mode, estimate the normals per tile with this number of nearest neighbours instead of reading 'normals.npy'", false, 0, "int", cmd);
+      TCLAP::SwitchArg terminationSwitch("t", "termination", "also write 'ma_termination_in.npy' and 'ma_termination_out.npy', one uint8 per ball with the reason the shrinking stopped in the upper 3 bits (0 converged, 1 q equal to p, 2 non-finite center, 3 planar denoise, 4 preserve denoise, 5 iteration cap, 6 invalid input) and the number of iterations (saturated at 31) in the lower 5 bits", cmd, false);
+      TCLAP::ValueArg<std::string> statsArg("", "stats-json", "write the stage timings, counters and peak memory use of the run to this JSON file", false, "", "file", cmd);
 
       cmd.parse(argc, argv);
 
@@ -53,31 +67,95 @@ int main(int argc, char **argv) {
       input_parameters.denoise_preserve = (M_PI / 180.0) * denoise_preserveArg.getValue();
       input_parameters.denoise_planar = (M_PI / 180.0) * denoise_planarArg.getValue();
       input_parameters.nan_for_initr = nan_for_initrSwitch.getValue();
+      input_parameters.warm_start = warm_startSwitch.getValue();
+      input_parameters.packet_kernel = packetSwitch.getValue();
 
       std::string output_path = outputArg.isSet() ? outputArg.getValue() : inputArg.getValue();
 
-      std::cout << "Parameters: denoise_preserve=" << denoise_preserveArg.getValue() << ", denoise_planar=" << denoise_planarArg.getValue() << ", initial_radius=" << input_parameters.initial_radius << "\n";
+      // the stages are printed as they finish
+      std::shared_ptr<stats_recorder> stats(new stats_recorder(&std::cout));
+
+      std::cout << "Parameters: denoise_preserve=" << denoise_preserveArg.getValue() << ", denoise_planar=" << denoise_planarArg.getValue() << ", initial_radius=" << input_parameters.initial_radius << ", warm_start=" << input_parameters.warm_start << ", packet_kernel=" << input_parameters.packet_kernel << "\n";
+
+      radius_estimate estimate = {};
+      std::vector<radius_estimate> regions;
+      if (memoryArg.isSet()) {
+         // the pilot needs the kd-tree of the whole input
+         if (estimate_radiusSwitch.getValue())
+            throw TCLAP::ArgParseException("cannot be combined with tiled mode", "estimate-radius");
+         // the in-core run has no normals to compare against the normals of the tiles
+         if (verify_tiledSwitch.getValue() && tile_normalsArg.isSet())
+            throw TCLAP::ArgParseException("cannot be combined with --tile-normals", "verify-tiled");
+
+         tiling_parameters tiling_params;
+         tiling_params.memory_budget = memoryArg.getValue() * 1024 * 1024;
+         tiling_params.halo = haloArg.getValue();
+         tiling_params.compute_normals = tile_normalsArg.isSet();
+         tiling_params.spatial_sort = sortSwitch.getValue();
+         tiling_params.termination = terminationSwitch.getValue();
+
+         normals_parameters normals_params;
+         normals_params.k = tile_normalsArg.getValue();
+
+         // warm starting and sorting visit the points of a tile in another order than in-core
+         if (verify_tiledSwitch.getValue()) {
+            input_parameters.warm_start = false;
+            tiling_params.spatial_sort = false;
+         }
 
-      io_parameters io_params = {};
-      io_params.coords = true;
-      io_params.normals = true;
+         compute_masb_points_tiled(tiling_params, normals_params, input_parameters, inputArg.getValue(), output_path, stats);
 
-      ma_data madata = {};
-      npy2madata(inputArg.getValue(), madata, io_params);
+         if (verify_tiledSwitch.getValue()) {
+            size_t mismatches = compare_ma_tiled(input_parameters, inputArg.getValue(), output_path, stats);
+            std::cout << "Tiled: " << mismatches << " balls differ from the in-core computation" << std::endl;
+            if (mismatches)
+               return 1;
+         }
+      } else {
+         if (verify_tiledSwitch.getValue())
+            throw TCLAP::ArgParseException("only works in tiled mode (-m)", "verify-tiled");
+
+         io_parameters io_params = {};
+         io_params.coords = true;
+         io_params.normals = true;
+
+         ma_data madata = {};
+         madata.stats = stats;
+         npy2madata(inputArg.getValue(), madata, io_params);
+         if (sortSwitch.getValue())
+            sort_spatially(madata);
+
+         if (estimate_radiusSwitch.getValue()) {
+            estimate = estimate_initial_radius(input_parameters, madata, regions);
+            std::cout << "Estimated initial radius: at most " << estimate.radius << ", pilot balls take " << estimate.iterations_estimated
+               << " instead of " << estimate.iterations_given << " iterations on average, " << estimate.balls_differ << " out of "
+               << estimate.pilot_balls << " would change" << std::endl;
+         }
 
-      // Perform the actual processing
-      madata.ma_coords.reset(new PointCloud);
-      madata.ma_coords->resize(2 * madata.coords->size());
-      madata.ma_qidx.resize(2 * madata.coords->size());
-	  madata.ma_radius.resize(2 * madata.coords->size());
-      compute_masb_points(input_parameters, madata);
+         // Perform the actual processing
+         madata.ma_coords.reset(new point_array);
+         madata.ma_coords->resize(2 * madata.coords->size());
+         madata.ma_qidx.resize(2 * madata.coords->size());
+         madata.ma_radius.resize(2 * madata.coords->size());
+         if (terminationSwitch.getValue())
+            madata.ma_termination.resize(2 * madata.coords->size());
+         if (verify_packetSwitch.getValue()) {
+            size_t mismatches = compare_ma_kernels(input_parameters, madata);
+            std::cout << "Packet kernel: " << mismatches << " out of " << madata.ma_qidx.size() << " balls differ from the scalar kernel" << std::endl;
+            if (mismatches)
+               return 1;
+         } else {
+            compute_masb_points(input_parameters, madata);
+         }
 
-      io_params.coords = false;
-      io_params.normals = false;
-      io_params.ma_coords = true;
-      io_params.ma_qidx = true;
-	  io_params.ma_radius = true;
-      madata2npy(output_path, madata, io_params);
+         io_params.coords = false;
+         io_params.normals = false;
+         io_params.ma_coords = true;
+         io_params.ma_qidx = true;
+         io_params.ma_radius = true;
+         io_params.ma_termination = terminationSwitch.getValue();
+         madata2npy(output_path, madata, io_params);
+      }
 
       {
          std::string output_path_metadata = output_path + "/compute_ma";
@@ -92,9 +170,25 @@ int main(int argc, char **argv) {
             << "initial_radius " << input_parameters.initial_radius << std::endl
             << "nan_for_initr " << input_parameters.nan_for_initr << std::endl
             << "denoise_preserve " << denoise_preserveArg.getValue() << std::endl
-            << "denoise_planar " << denoise_planarArg.getValue() << std::endl;
+            << "denoise_planar " << denoise_planarArg.getValue() << std::endl
+            << "warm_start " << input_parameters.warm_start << std::endl;
+         if (estimate_radiusSwitch.getValue()) {
+            metadata
+               << "estimated_radius " << estimate.radius << std::endl
+               << "pilot_balls " << estimate.pilot_balls << std::endl
+               << "pilot_iterations_given_radius " << estimate.iterations_given << std::endl
+               << "pilot_iterations_estimated_radius " << estimate.iterations_estimated << std::endl
+               << "pilot_balls_differ " << estimate.balls_differ << std::endl;
+            // one line per region, row by row from the minimum y: radius, pilot balls, both averages, pilot balls that differ
+            for (const radius_estimate &e : regions)
+               metadata << "region_estimate " << e.radius << " " << e.pilot_balls << " " << e.iterations_given << " "
+                  << e.iterations_estimated << " " << e.balls_differ << std::endl;
+         }
          metadata.close();
       }
+
+      if (statsArg.isSet())
+         stats->write_json(statsArg.getValue());
    }
    catch (TCLAP::ArgException &e) { std::cerr << "Error: " << e.error() << " for " << e.argId() << std::endl; }
 
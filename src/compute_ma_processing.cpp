@@ -21,83 +21,103 @@ SOFTWARE.
 */
 
 #include "compute_ma_processing.h"
+#include "kdtree.h"
+#include "parallel.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <limits>
 
-#ifdef VERBOSEPRINT
-#include <chrono>
-#include <iostream>
-#endif
-
-#ifdef WITH_OPENMP
-#include <omp.h>
-#endif
-
-#ifdef VERBOSEPRINT
-typedef std::chrono::high_resolution_clock Clock;
-#endif
-
 //==============================
 //   COMPUTE MA
 //==============================
 
 const Scalar delta_convergance = 1E-5f;
 const unsigned int iteration_limit = 30;
-const Point nanPoint(std::numeric_limits<Scalar>::quiet_NaN(), std::numeric_limits<Scalar>::quiet_NaN(), std::numeric_limits<Scalar>::quiet_NaN());
-
-inline Scalar compute_radius(const Vector3 &p, const Vector3 &n, const Vector3 &q) {
+// A warm-started ball starts at this multiple of the largest radius found for the last warm_start_window
+// (neighbouring) points, and is grown by warm_start_growth as long as it is empty
+const Scalar warm_start_margin = 1.1f;
+const int warm_start_window = 4;
+const Scalar warm_start_growth = 4.0f;
+const Vector3 nanPoint = Vector3::Constant(std::numeric_limits<Scalar>::quiet_NaN());
+
+// The ball updates are written out per component, so that the scalar and the packet kernel evaluate
+// exactly the same expressions and give bit-for-bit equal results (also with -ffast-math)
+inline Scalar compute_radius(Scalar px, Scalar py, Scalar pz, Scalar nx, Scalar ny, Scalar nz, Scalar qx, Scalar qy, Scalar qz) {
    // Compute radius of the ball that touches points p and q and whose center falls on the normal n from p
-   Scalar d = (p - q).norm();
-   Scalar cos_theta = n.dot(p - q) / d;
+   Scalar dx = px - qx, dy = py - qy, dz = pz - qz;
+   Scalar d = std::sqrt(dx * dx + dy * dy + dz * dz);
+   Scalar cos_theta = (nx * dx + ny * dy + nz * dz) / d;
    return Scalar(d / (2 * cos_theta));
 }
 
-inline Scalar cos_angle(const Vector3 p, const Vector3 q) {
+inline Scalar compute_radius(const Vector3 &p, const Vector3 &n, const Vector3 &q) {
+   return compute_radius(p[0], p[1], p[2], n[0], n[1], n[2], q[0], q[1], q[2]);
+}
+
+inline Scalar cos_angle(Scalar px, Scalar py, Scalar pz, Scalar qx, Scalar qy, Scalar qz) {
    // Calculate the cosine of angle between vector p and q, see http://en.wikipedia.org/wiki/Law_of_cosines#Vector_formulation
-   Scalar result = p.dot(q) / (p.norm() * q.norm());
+   Scalar result = (px * qx + py * qy + pz * qz) / (std::sqrt(px * px + py * py + pz * pz) * std::sqrt(qx * qx + qy * qy + qz * qz));
    if (result > 1) return 1;
    else if (result < -1) return -1;
    return result;
 }
 
-ma_result sb_point(const ma_parameters &input_parameters, const Vector3 &p, const Vector3 &n, pcl::search::KdTree<Point>::Ptr kd_tree) {
+inline Scalar cos_angle(const Vector3 p, const Vector3 q) {
+   return cos_angle(p[0], p[1], p[2], q[0], q[1], q[2]);
+}
+
+ma_result sb_point(const ma_parameters &input_parameters, const Vector3 &p, const Vector3 &n, const nn_search &kd_tree, Scalar initial_radius) {
    // Calculate a medial ball for a given oriented point using the shrinking ball algorithm,
    // see https://3d.bk.tudelft.nl/rypeters/pdfs/16candg.pdf section 3.2 for details
    unsigned int j = 0;
-   Scalar r = input_parameters.initial_radius, d;
+   Scalar r = initial_radius, d;
    Vector3 q, c_next;
    int qidx = -1, qidx_next;
-   Point c; c.getVector3fMap() = p - n * r;
+   Vector3 c = p - n * r;
 
    // We can't continue if we have bad input, we won't be able to perform nearest neighbour searches
-   if (!c.getVector3fMap().allFinite())
-      return{ nanPoint, -1 };
+   if (!finite_bits(c))
+      return{ nanPoint, -1, -1, 0, sb_termination::invalid_input };
 
-   // Results from our search
-   std::vector<int> k_indices(1);
-   std::vector<Scalar> k_distances(1);
+   const point_array &cloud = *kd_tree.input_cloud();
+   sb_termination termination;
 
    while (true) {
-      // find closest point to c
-      kd_tree->nearestKSearch(c, 1, k_indices, k_distances);
-
-      qidx_next = k_indices[0];
-      q = kd_tree->getInputCloud()->at(qidx_next).getVector3fMap();
-      d = k_distances[0];
+      // find closest point to c. Bounding the search by the radius doesn't prune more: the last ball touches
+      // its q at distance r, so the unbounded search visits the same cells to find it.
+      qidx_next = kd_tree.nearest(c, d);
+      q = cloud[qidx_next];
 
       // This should handle all (special) cases where we want to break the loop
       // - normal case when ball no longer shrinks
       // - the case where q==p
       // - any duplicate point cases
-      if ((d >= (r-delta_convergance)*(r-delta_convergance)) || (p==q))
-            break;
+      if (d >= (r-delta_convergance)*(r-delta_convergance)) {
+         termination = sb_termination::converged;
+         break;
+      }
+      if (p == q) {
+         termination = sb_termination::same_point;
+         break;
+      }
+      // The ball touches the same point as in the previous step, so the next step gives the same ball.
+      // This happens when delta_convergance is below the float resolution at radius r.
+      if (qidx_next == qidx) {
+         termination = sb_termination::converged;
+         break;
+      }
 
       // Compute next ball center
       r = compute_radius(p, n, q);
       c_next = p - n * r;
 
-      if (!c_next.allFinite())
+      if (!finite_bits(c_next)) {
+         termination = sb_termination::non_finite;
          break;
+      }
 
       // Denoising
       if (input_parameters.denoise_preserve || input_parameters.denoise_planar) {
@@ -105,94 +125,609 @@ ma_result sb_point(const ma_parameters &input_parameters, const Vector3 &p, cons
          Scalar separation_angle = std::acos(a);
 
          if (j == 0 && input_parameters.denoise_planar > 0 && separation_angle < input_parameters.denoise_planar) {
+            termination = sb_termination::planar_denoise;
             break;
          }
          if (j > 0 && input_parameters.denoise_preserve > 0 && (separation_angle < input_parameters.denoise_preserve && r > (q - p).norm())) {
+            termination = sb_termination::preserve_denoise;
             break;
          }
       }
 
       // Stop iteration if this looks like an infinite loop:
-      if (j > iteration_limit)
+      if (j > iteration_limit) {
+         termination = sb_termination::iteration_cap;
          break;
+      }
 
-      c.getVector3fMap() = c_next;
+      c = c_next;
       qidx = qidx_next;
       j++;
    }
 
    if (j == 0 && input_parameters.nan_for_initr)
-      return{ nanPoint, -1,-1 };
+      return{ nanPoint, -1, -1, j + 1, termination };
    else
-      return{ c, qidx, r };
+      return{ c, qidx, r, j + 1, termination };
 }
 
-void sb_points(ma_parameters &input_parameters, ma_data &madata, bool inner, progress_callback callback) {
-   // outer mat should be written to second half of ma_coords/ma_qidx
-   size_t offset = 0;
-   if (inner == false)
-      offset = madata.coords->size();
+// Counts of the balls of one thread by their number of iterations and their termination. The threads
+// count separately and merge their counts at the end.
+struct sb_telemetry {
+   uint64_t iterations[iteration_limit + 3]; // a ball stops after at most iteration_limit + 2 queries
+   uint64_t terminations[sb_termination_count];
+   uint64_t restarts; // warm-started balls that were shrunk again from a larger radius
 
-   size_t progress = offset;
-   size_t accum = 0;
-#pragma omp parallel for firstprivate(accum)
-   for (int i = 0; i < madata.coords->size(); i++)
-   {
-      Vector3 p = (*madata.coords)[i].getVector3fMap();
-      Vector3 n;
-      if (inner)
-         n = (*madata.normals)[i].getNormalVector3fMap();
+   sb_telemetry() : iterations(), terminations(), restarts(0) {}
+
+   void add(const ma_result &r) {
+      iterations[r.iterations]++;
+      terminations[int(r.termination)]++;
+   }
+
+   void merge(const sb_telemetry &other) {
+      for (unsigned int i = 0; i < iteration_limit + 3; i++)
+         iterations[i] += other.iterations[i];
+      for (int t = 0; t < sb_termination_count; t++)
+         terminations[t] += other.terminations[t];
+      restarts += other.restarts;
+   }
+
+   void report(stats_sink *sink) const {
+      static const char *names[sb_termination_count] = {
+         "ma/termination/converged", "ma/termination/same_point", "ma/termination/non_finite",
+         "ma/termination/planar_denoise", "ma/termination/preserve_denoise", "ma/termination/iteration_cap",
+         "ma/termination/invalid_input" };
+      sink->histogram("ma/iterations", std::vector<uint64_t>(iterations, iterations + iteration_limit + 3));
+      for (int t = 0; t < sb_termination_count; t++)
+         sink->count(names[t], terminations[t]);
+      sink->count("ma/warm_start_restarts", restarts);
+   }
+};
+
+// The radii of the last balls of one side (interior or exterior) that shrank. A ball that didn't shrink
+// empties the window, so that the next ball starts cold.
+struct seed_window {
+   Scalar radius[warm_start_window];
+   int size, at;
+
+   seed_window() : radius(), size(0), at(0) {}
+
+   void add(const ma_result &r) {
+      if (r.iterations > 1 && r.radius > 0 && finite_bits(r.radius)) {
+         radius[at] = r.radius;
+         at = (at + 1) % warm_start_window;
+         size = std::min(size + 1, warm_start_window);
+      }
       else
-         n = -(*madata.normals)[i].getNormalVector3fMap();
+         size = at = 0;
+   }
 
-      ma_result r = sb_point(input_parameters, p, n, madata.kd_tree);
+   Scalar seed(Scalar initial_radius) const {
+      if (size == 0)
+         return initial_radius;
+      Scalar largest = *std::max_element(radius, radius + size);
+      return std::min(Scalar(largest * warm_start_margin), initial_radius);
+   }
+};
+
+inline Scalar next_seed(const ma_parameters &input_parameters, Scalar radius, sb_termination termination) {
+   // The radius to retry from after a warm-started ball stopped in its first step. The balls that touch p
+   // with their center on the normal are nested, so if the seed ball was empty the true ball is larger:
+   // grow it. If it was stopped otherwise (by the planar denoising), fall back to the initial radius.
+   if (termination == sb_termination::converged)
+      return std::min(Scalar(radius * warm_start_growth), input_parameters.initial_radius);
+   return input_parameters.initial_radius;
+}
 
-      (*madata.ma_coords)[i + offset] = r.c;
-      madata.ma_qidx[i + offset] = r.qidx;
-	  madata.ma_radius[i + offset] = r.radius;
+inline ma_result sb_point_seeded(const ma_parameters &input_parameters, const Vector3 &p, const Vector3 &n, const nn_search &kd_tree, seed_window &window, size_t &iterations, sb_telemetry &telemetry) {
+   // Shrink a ball from the seed of the window (the initial radius without warm starting), and update
+   // the window for the next point
+   Scalar radius = input_parameters.warm_start ? window.seed(input_parameters.initial_radius) : input_parameters.initial_radius;
+   ma_result r;
+   while (true) {
+      r = sb_point(input_parameters, p, n, kd_tree, radius);
+      iterations += r.iterations;
+      if (r.iterations > 1 || radius >= input_parameters.initial_radius)
+         break;
+      radius = next_seed(input_parameters, radius, r.termination);
+      telemetry.restarts++;
+   }
 
-      accum++;
-      if (accum == 5000)
+   if (input_parameters.warm_start)
+      window.add(r);
+   return r;
+}
+
+size_t sb_points(ma_parameters &input_parameters, ma_data &madata, progress_callback callback, chunk_callback prepare) {
+   // The interior and exterior ball of each point are computed in the same pass. Interior balls
+   // are written to the first half of ma_coords/ma_qidx/ma_radius, exterior balls to the second half.
+   size_t offset = madata.coords->size();
+
+   // With warm starting we visit the points in spatially coherent order, so that the previous point
+   // handled by the same thread is (nearly always) a neighbour of the current one. Points that were
+   // sorted with sort_spatially already are in that order.
+   std::vector<int> order;
+   if (input_parameters.warm_start && madata.order.empty())
+      order = spatial_order(*madata.coords);
+
+   // The number of shrinking iterations varies a lot from point to point, the threads take chunks
+   // of consecutive (and thus with warm starting or sorting, neighbouring) points from a shared queue
+   const int n_points = int(madata.coords->size());
+   const int n_chunks = (n_points + dynamic_chunk_size - 1) / dynamic_chunk_size;
+   progress_counter progress(callback);
+   load_balance balance;
+   size_t iterations = 0;
+   stats_sink *stats = madata.stats.get();
+   bool record = madata.ma_termination.size() == madata.ma_qidx.size();
+   sb_telemetry telemetry;
+#pragma omp parallel reduction(+:iterations)
+   {
+      balance.start();
+      size_t accum = 0;
+      seed_window seed_inner, seed_outer;
+      sb_telemetry thread_telemetry;
+      std::vector<int> chunk;
+      chunk.reserve(dynamic_chunk_size);
+#pragma omp for schedule(dynamic, 1) nowait
+      for (int c = 0; c < n_chunks; c++)
       {
+         chunk.clear();
+         for (int k = c * dynamic_chunk_size; k < std::min(n_points, (c + 1) * dynamic_chunk_size); k++)
+            chunk.push_back(order.empty() ? k : order[k]);
+         if (prepare)
+            prepare(chunk);
+
+         for (int i : chunk) {
+            Vector3 p = (*madata.coords)[i];
+            Vector3 n = (*madata.normals)[i];
+
+            ma_result r = sb_point_seeded(input_parameters, p, n, *madata.kd_tree, seed_inner, iterations, thread_telemetry);
+            madata.ma_coords->set(i, r.c);
+            madata.ma_qidx[i] = r.qidx;
+            madata.ma_radius[i] = r.radius;
+            if (record)
+               madata.ma_termination[i] = pack_termination(r);
+            if (stats)
+               thread_telemetry.add(r);
+
+            r = sb_point_seeded(input_parameters, p, -n, *madata.kd_tree, seed_outer, iterations, thread_telemetry);
+            madata.ma_coords->set(i + offset, r.c);
+            madata.ma_qidx[i + offset] = r.qidx;
+            madata.ma_radius[i + offset] = r.radius;
+            if (record)
+               madata.ma_termination[i + offset] = pack_termination(r);
+            if (stats)
+               thread_telemetry.add(r);
+
+            accum += 2;
+            if (accum == 500)
+            {
+               progress.add(accum);
+               accum = 0;
+            }
+         }
+      }
+      progress.add(accum);
+      balance.finish();
+      if (stats) {
 #pragma omp critical
+         telemetry.merge(thread_telemetry);
+      }
+   }
+
+   if (stats) {
+      balance.report(stats, "ma/shrink");
+      telemetry.report(stats);
+   }
+   return iterations;
+}
+
+//==============================
+//   PACKET KERNEL
+//==============================
+
+// Number of shrinking balls that are advanced in lockstep. 16 lanes fill one AVX-512 register,
+// two AVX2 or four SSE registers.
+const int packet_size = 16;
+
+struct sb_packet {
+   // Lane state in structure-of-arrays layout, so that the per-lane arithmetic vectorizes
+   Scalar px[packet_size], py[packet_size], pz[packet_size];
+   Scalar nx[packet_size], ny[packet_size], nz[packet_size];
+   Scalar cx[packet_size], cy[packet_size], cz[packet_size];
+   Scalar qx[packet_size], qy[packet_size], qz[packet_size];
+   Scalar r[packet_size], d[packet_size];
+
+   // Outputs of sb_packet_step
+   Scalar r_next[packet_size];
+   Scalar cx_next[packet_size], cy_next[packet_size], cz_next[packet_size];
+   Scalar cos_a[packet_size];
+   int converged[packet_size];
+};
+
+MASB_TARGET_CLONES
+void sb_packet_step(sb_packet &pk) {
+   // The compute_radius and cos_angle updates of sb_point for all lanes
+   for (int l = 0; l < packet_size; l++) {
+      Scalar rr = pk.r[l] - delta_convergance;
+      // bitwise instead of logical operators, to keep the loop free of branches
+      pk.converged[l] = (pk.d[l] >= rr * rr) | ((pk.px[l] == pk.qx[l]) & (pk.py[l] == pk.qy[l]) & (pk.pz[l] == pk.qz[l]));
+
+      Scalar r = compute_radius(pk.px[l], pk.py[l], pk.pz[l], pk.nx[l], pk.ny[l], pk.nz[l], pk.qx[l], pk.qy[l], pk.qz[l]);
+      Scalar cx = pk.px[l] - pk.nx[l] * r, cy = pk.py[l] - pk.ny[l] * r, cz = pk.pz[l] - pk.nz[l] * r;
+
+      pk.r_next[l] = r;
+      pk.cx_next[l] = cx; pk.cy_next[l] = cy; pk.cz_next[l] = cz;
+      pk.cos_a[l] = cos_angle(pk.px[l] - cx, pk.py[l] - cy, pk.pz[l] - cz, pk.qx[l] - cx, pk.qy[l] - cy, pk.qz[l] - cz);
+   }
+}
+
+size_t sb_points_packet(ma_parameters &input_parameters, ma_data &madata, progress_callback callback, chunk_callback prepare) {
+   // Same results as sb_points, but every thread advances packet_size balls at a time. The
+   // nearest neighbour queries are done per lane, the ball updates for all lanes at once.
+   // A lane whose ball is finished is refilled with the next ball from the thread's current chunk of
+   // work, the chunks are taken from a shared queue as in sb_points.
+   size_t offset = madata.coords->size();
+
+   std::vector<int> order;
+   if (input_parameters.warm_start && madata.order.empty())
+      order = spatial_order(*madata.coords);
+
+   const nn_search &kd_tree = *madata.kd_tree;
+   const point_array &cloud = *kd_tree.input_cloud();
+
+   // Work item t is the interior (t even) or exterior (t odd) ball of point t / 2
+   const long long n_items = 2 * (long long)madata.coords->size();
+   const long long chunk_items = 2 * dynamic_chunk_size;
+   std::atomic<long long> next_chunk(0);
+   progress_counter progress(callback);
+   load_balance balance;
+   size_t iterations = 0;
+   stats_sink *stats = madata.stats.get();
+   bool record = madata.ma_termination.size() == madata.ma_qidx.size();
+   sb_telemetry telemetry;
+#pragma omp parallel reduction(+:iterations)
+   {
+      balance.start();
+      long long next = 0, end = 0;
+      sb_telemetry thread_telemetry;
+
+      sb_packet pk = {};
+      long long item[packet_size];
+      unsigned int j[packet_size];
+      int qidx[packet_size], qidx_next[packet_size];
+      Scalar seed[packet_size];
+      seed_window seeds[packet_size][2];
+      int active = 0;
+      size_t accum = 0;
+      std::vector<int> chunk;
+
+      auto finish = [&](int l, const ma_result &r) {
+         int i = order.empty() ? int(item[l] / 2) : order[item[l] / 2];
+         int side = int(item[l] % 2);
+         madata.ma_coords->set(i + side * offset, r.c);
+         madata.ma_qidx[i + side * offset] = r.qidx;
+         madata.ma_radius[i + side * offset] = r.radius;
+         if (record)
+            madata.ma_termination[i + side * offset] = pack_termination(r);
+         if (stats)
+            thread_telemetry.add(r);
+
+         if (input_parameters.warm_start)
+            seeds[l][side].add(r);
+
+         accum++;
+         if (accum == 500)
          {
-            progress += accum;
-            if (callback)
-               callback(progress);
+            progress.add(accum);
+            accum = 0;
+         }
+      };
+
+      // Start the ball of the current item in lane l, returns false if the ball can't be started
+      auto start = [&](int l, Scalar radius) {
+         int i = order.empty() ? int(item[l] / 2) : order[item[l] / 2];
+         Vector3 p = cloud[i];
+         Vector3 n = (*madata.normals)[i];
+         if (item[l] % 2)
+            n = -n;
+         Vector3 c = p - n * radius;
+         if (!finite_bits(c))
+            return false;
+         pk.px[l] = p[0]; pk.py[l] = p[1]; pk.pz[l] = p[2];
+         pk.nx[l] = n[0]; pk.ny[l] = n[1]; pk.nz[l] = n[2];
+         pk.cx[l] = c[0]; pk.cy[l] = c[1]; pk.cz[l] = c[2];
+         pk.r[l] = radius;
+         j[l] = 0;
+         qidx[l] = -1;
+         return true;
+      };
+
+      // Fill lane l with the next item that can be started, returns false if the work is done
+      auto refill = [&](int l) {
+         while (true) {
+            if (next == end) {
+               next = next_chunk.fetch_add(chunk_items);
+               if (next >= n_items) {
+                  next = end;
+                  break;
+               }
+               end = std::min(next + chunk_items, n_items);
+               if (prepare) {
+                  chunk.clear();
+                  for (long long t = next; t < end; t += 2)
+                     chunk.push_back(order.empty() ? int(t / 2) : order[t / 2]);
+                  prepare(chunk);
+               }
+            }
+            item[l] = next++;
+            seed[l] = input_parameters.warm_start ? seeds[l][item[l] % 2].seed(input_parameters.initial_radius) : input_parameters.initial_radius;
+            if (start(l, seed[l]))
+               return true;
+            finish(l, { nanPoint, -1, -1, 0, sb_termination::invalid_input });
+         }
+         item[l] = -1;
+         return false;
+      };
+
+      for (int l = 0; l < packet_size; l++)
+         if (refill(l))
+            active++;
+
+      while (active > 0) {
+         // find closest point to c
+         for (int l = 0; l < packet_size; l++) {
+            if (item[l] < 0) continue;
+            qidx_next[l] = kd_tree.nearest(Vector3(pk.cx[l], pk.cy[l], pk.cz[l]), pk.d[l]);
+            pk.qx[l] = cloud.x[qidx_next[l]]; pk.qy[l] = cloud.y[qidx_next[l]]; pk.qz[l] = cloud.z[qidx_next[l]];
+            iterations++;
          }
-         accum = 0;
+
+         sb_packet_step(pk);
+
+         for (int l = 0; l < packet_size; l++) {
+            if (item[l] < 0) continue;
+
+            // Same break conditions as in sb_point
+            sb_termination termination;
+            bool done = pk.converged[l];
+            if (done) {
+               Scalar rr = pk.r[l] - delta_convergance;
+               termination = pk.d[l] >= rr * rr ? sb_termination::converged : sb_termination::same_point;
+            }
+            else if (qidx_next[l] == qidx[l]) {
+               done = true;
+               termination = sb_termination::converged;
+            }
+            else {
+               pk.r[l] = pk.r_next[l];
+               done = !finite_bits(Vector3(pk.cx_next[l], pk.cy_next[l], pk.cz_next[l]));
+               termination = sb_termination::non_finite;
+            }
+            if (!done && (input_parameters.denoise_preserve || input_parameters.denoise_planar)) {
+               Scalar separation_angle = std::acos(pk.cos_a[l]);
+               Scalar qp = (Vector3(pk.qx[l], pk.qy[l], pk.qz[l]) - Vector3(pk.px[l], pk.py[l], pk.pz[l])).norm();
+               if (j[l] == 0 && input_parameters.denoise_planar > 0 && separation_angle < input_parameters.denoise_planar) {
+                  done = true;
+                  termination = sb_termination::planar_denoise;
+               }
+               else if (j[l] > 0 && input_parameters.denoise_preserve > 0 && (separation_angle < input_parameters.denoise_preserve && pk.r[l] > qp)) {
+                  done = true;
+                  termination = sb_termination::preserve_denoise;
+               }
+            }
+            if (!done && j[l] > iteration_limit) {
+               done = true;
+               termination = sb_termination::iteration_cap;
+            }
+
+            if (!done) {
+               pk.cx[l] = pk.cx_next[l]; pk.cy[l] = pk.cy_next[l]; pk.cz[l] = pk.cz_next[l];
+               qidx[l] = qidx_next[l];
+               j[l]++;
+               continue;
+            }
+
+            // A warm-started ball that stops in its first step is recomputed from a larger radius
+            if (j[l] == 0 && seed[l] < input_parameters.initial_radius) {
+               seed[l] = next_seed(input_parameters, seed[l], termination);
+               thread_telemetry.restarts++;
+               if (start(l, seed[l]))
+                  continue;
+               finish(l, { nanPoint, -1, -1, 0, sb_termination::invalid_input });
+            }
+            else if (j[l] == 0 && input_parameters.nan_for_initr)
+               finish(l, { nanPoint, -1, -1, j[l] + 1, termination });
+            else {
+               finish(l, { Vector3(pk.cx[l], pk.cy[l], pk.cz[l]), qidx[l], pk.r[l], j[l] + 1, termination });
+            }
+
+            if (!refill(l))
+               active--;
+         }
+      }
+      progress.add(accum);
+      balance.finish();
+      if (stats) {
+#pragma omp critical
+         telemetry.merge(thread_telemetry);
       }
    }
+
+   if (stats) {
+      balance.report(stats, "ma/shrink");
+      telemetry.report(stats);
+   }
+   return iterations;
 }
 
-void compute_masb_points(ma_parameters &input_parameters, ma_data &madata, progress_callback callback) {
-#ifdef VERBOSEPRINT
-   auto start_time = Clock::now();
-#endif
-
-   if (!madata.kd_tree) {
-      madata.kd_tree.reset(new pcl::search::KdTree<Point>());
-      madata.kd_tree->setInputCloud(madata.coords);
-#ifdef VERBOSEPRINT
-      auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-      std::cout << "Constructed kd-tree in " << elapsed_time.count() << " ms" << std::endl;
-      start_time = Clock::now();
-#endif
-   }
-
-   // Inside processing
-   sb_points(input_parameters, madata, 1, callback);
-#ifdef VERBOSEPRINT
-   auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-   std::cout << "Done shrinking interior balls, took " << elapsed_time.count() << " ms" << std::endl;
-   start_time = Clock::now();
-#endif
-
-   // Outside processing
-   //sb_points(input_parameters, madata, 0, callback);
-#ifdef VERBOSEPRINT
-   elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-   std::cout << "Done shrinking exterior balls, took " << elapsed_time.count() << " ms" << std::endl;
-#endif
+size_t compute_masb_points(ma_parameters &input_parameters, ma_data &madata, progress_callback callback, chunk_callback prepare) {
+   stats_sink *stats = madata.stats.get();
+   stage_timer timer(stats, "ma/kd_tree");
+   if (!madata.kd_tree)
+      madata.kd_tree.reset(new kdtree(madata.coords));
+   timer.next("ma/shrink");
+
+   // Inside and outside processing
+   size_t iterations;
+   if (input_parameters.packet_kernel)
+      iterations = sb_points_packet(input_parameters, madata, callback, prepare);
+   else
+      iterations = sb_points(input_parameters, madata, callback, prepare);
+   timer.stop();
+
+   if (stats) {
+      // Every shrinking iteration is one nearest neighbour query. The balls that have no result are
+      // written as nanPoint with radius -1; that is tested on the radius, since -ffast-math may drop NaN tests.
+      size_t nan_results = 0;
+      for (size_t i = 0; i < madata.ma_radius.size(); i++)
+         nan_results += madata.ma_qidx[i] < 0 && madata.ma_radius[i] < 0;
+      stats->count("ma/kd_tree_queries", iterations);
+      stats->count("ma/nan_results", nan_results);
+      stats->value("ma/average_iterations", double(iterations) / (2 * madata.coords->size()));
+   }
+   return iterations;
 }
 
+
+size_t compare_ma_kernels(ma_parameters &input_parameters, ma_data &madata) {
+   // Warm starting seeds the balls in a different order in both kernels, so compare cold starts
+   ma_parameters parameters = input_parameters;
+   parameters.warm_start = false;
+
+   parameters.packet_kernel = false;
+   compute_masb_points(parameters, madata);
+   point_array scalar_coords = *madata.ma_coords;
+   std::vector<int> scalar_qidx = madata.ma_qidx;
+   std::vector<float> scalar_radius = madata.ma_radius;
+
+   parameters.packet_kernel = true;
+   compute_masb_points(parameters, madata);
+
+   return count_ma_mismatches(scalar_coords, scalar_qidx, scalar_radius, madata);
+}
+
+size_t count_ma_mismatches(const point_array &ma_coords, const std::vector<int> &ma_qidx, const std::vector<float> &ma_radius, const ma_data &madata) {
+   // Bitwise comparison, so that NaN results compare equal
+   size_t mismatches = 0;
+   for (size_t i = 0; i < ma_qidx.size(); i++) {
+      if (std::memcmp(&ma_coords.x[i], &madata.ma_coords->x[i], sizeof(Scalar)) != 0 ||
+         std::memcmp(&ma_coords.y[i], &madata.ma_coords->y[i], sizeof(Scalar)) != 0 ||
+         std::memcmp(&ma_coords.z[i], &madata.ma_coords->z[i], sizeof(Scalar)) != 0 ||
+         std::memcmp(&ma_radius[i], &madata.ma_radius[i], sizeof(float)) != 0 ||
+         ma_qidx[i] != madata.ma_qidx[i])
+         mismatches++;
+   }
+   return mismatches;
+}
+
+//==============================
+//   INITIAL RADIUS ESTIMATION
+//==============================
+
+// A region's estimate is this multiple of the largest pilot ball in it, as a margin for the points that were not sampled
+const Scalar radius_estimate_margin = 2.0f;
+
+// Shrinks the balls of the pilot points, pilot[k] from radius[k]. Result s is the interior (s even) or exterior (s odd)
+// ball of pilot[s / 2].
+void pilot_run(const ma_parameters &input_parameters, const ma_data &madata, const std::vector<int> &pilot, const std::vector<Scalar> &radius, std::vector<ma_result> &results) {
+   results.resize(2 * pilot.size());
+#pragma omp parallel for schedule(dynamic, 16)
+   for (long long s = 0; s < (long long)results.size(); s++) {
+      int i = pilot[s / 2];
+      Vector3 n = (*madata.normals)[i];
+      results[s] = sb_point(input_parameters, (*madata.coords)[i], s % 2 ? Vector3(-n) : n, *madata.kd_tree, radius[s / 2]);
+   }
+}
+
+radius_estimate estimate_initial_radius(const ma_parameters &input_parameters, ma_data &madata, std::vector<radius_estimate> &regions, int grid, size_t pilot_points) {
+   stats_sink *stats = madata.stats.get();
+   stage_timer timer(stats, "ma/kd_tree");
+   if (!madata.kd_tree)
+      madata.kd_tree.reset(new kdtree(madata.coords));
+   timer.next("ma/pilot");
+
+   // bounding box of the finite points
+   const point_array &coords = *madata.coords;
+   int N = int(coords.size());
+   Vector3 minPt = Vector3::Constant(std::numeric_limits<Scalar>::max());
+   Vector3 maxPt = Vector3::Constant(-std::numeric_limits<Scalar>::max());
+   for (int i = 0; i < N; i++) {
+      if (!coords.is_finite(i)) continue;
+      minPt = minPt.cwiseMin(coords[i]);
+      maxPt = maxPt.cwiseMax(coords[i]);
+   }
+   Scalar diagonal = minPt[0] <= maxPt[0] ? (maxPt - minPt).norm() : 0;
+
+   radius_estimate total = {};
+   regions.assign(grid * grid, radius_estimate());
+   if (N == 0 || !(diagonal > 0))
+      return total;
+
+   // The pilot points are spread evenly over the input, each falls in an xy cell of the grid over the bounding box
+   std::vector<int> pilot, region;
+   size_t n_pilot = std::min(pilot_points, size_t(N));
+   for (size_t k = 0; k < n_pilot; k++) {
+      int i = int(k * N / n_pilot);
+      if (!coords.is_finite(i)) continue;
+      int cell[2];
+      for (int d = 0; d < 2; d++) {
+         Scalar extent = maxPt[d] - minPt[d];
+         cell[d] = extent > 0 ? int((coords[i][d] - minPt[d]) / extent * grid) : 0;
+         cell[d] = std::max(0, std::min(grid - 1, cell[d]));
+      }
+      pilot.push_back(i);
+      region.push_back(cell[1] * grid + cell[0]);
+   }
+
+   // The balls that touch p with their center on the same side of the normal are nested: a ball that is empty
+   // at the diagonal is empty at any smaller radius, and without denoising a ball that shrinks to some radius from
+   // the diagonal shrinks to the same ball from any radius above that.
+   std::vector<ma_result> from_diagonal, from_given, from_estimate;
+   pilot_run(input_parameters, madata, pilot, std::vector<Scalar>(pilot.size(), diagonal), from_diagonal);
+   for (size_t s = 0; s < from_diagonal.size(); s++) {
+      const ma_result &r = from_diagonal[s];
+      if (r.iterations > 1 && r.radius > 0 && finite_bits(r.radius))
+         regions[region[s / 2]].radius = std::max(regions[region[s / 2]].radius, Scalar(r.radius));
+   }
+   for (radius_estimate &e : regions) {
+      e.radius = e.radius > 0 ? std::min(Scalar(e.radius * radius_estimate_margin), diagonal) : diagonal;
+      total.radius = std::max(total.radius, e.radius);
+   }
+
+   // Measure what the estimates would change, compared to the given initial radius
+   std::vector<Scalar> radius(pilot.size());
+   for (size_t k = 0; k < pilot.size(); k++)
+      radius[k] = regions[region[k]].radius;
+   pilot_run(input_parameters, madata, pilot, std::vector<Scalar>(pilot.size(), input_parameters.initial_radius), from_given);
+   pilot_run(input_parameters, madata, pilot, radius, from_estimate);
+   for (size_t s = 0; s < from_given.size(); s++) {
+      const ma_result &a = from_given[s], &b = from_estimate[s];
+      bool differ = a.qidx != b.qidx || std::memcmp(&a.radius, &b.radius, sizeof(double)) != 0;
+      for (radius_estimate *e : { &regions[region[s / 2]], &total }) {
+         e->pilot_balls++;
+         e->iterations_given += a.iterations;
+         e->iterations_estimated += b.iterations;
+         e->balls_differ += differ;
+      }
+   }
+   auto average = [](radius_estimate &e) {
+      if (e.pilot_balls) {
+         e.iterations_given /= e.pilot_balls;
+         e.iterations_estimated /= e.pilot_balls;
+      }
+   };
+   for (radius_estimate &e : regions)
+      average(e);
+   average(total);
+   timer.stop();
+
+   if (stats) {
+      stats->value("ma/estimated_initial_radius", total.radius);
+      stats->value("ma/pilot_iterations_given", total.iterations_given);
+      stats->value("ma/pilot_iterations_estimated", total.iterations_estimated);
+      stats->count("ma/pilot_balls_differ", total.balls_differ);
+   }
+   return total;
+}
@@ -25,6 +25,7 @@ SOFTWARE.
 
 #include "madata.h"
 
+#include <cstdint>
 #include <functional>
 
 struct ma_parameters {
@@ -32,16 +33,71 @@ struct ma_parameters {
    bool nan_for_initr;
    double denoise_preserve;
    double denoise_planar;
+   bool warm_start; // seed each ball from the radius of an already converged spatial neighbour
+   bool packet_kernel; // advance several balls in lockstep using the vector units
 };
 
+// Why the shrinking of a ball stopped
+enum class sb_termination : uint8_t {
+   converged,        // the nearest point is not closer to the center than the radius
+   same_point,       // the nearest point is p itself
+   non_finite,       // the next center is not finite
+   planar_denoise,   // first step, and the separation angle is below denoise_planar
+   preserve_denoise, // the separation angle is below denoise_preserve and the ball is larger than |q - p|
+   iteration_cap,    // more steps than the iteration limit
+   invalid_input     // the initial center is not finite, no queries were performed
+};
+const int sb_termination_count = 7;
+
 struct ma_result {
-   Point c;
+   Vector3 c;
    int qidx;
    double radius;
+   unsigned int iterations; // number of nearest neighbour queries performed
+   sb_termination termination;
 };
 
+// One byte per ball in ma_data::ma_termination: the sb_termination in the upper 3 bits, the number of
+// nearest neighbour queries in the lower 5 bits, saturated at 31 (a ball stopped by the cap has 32)
+inline uint8_t pack_termination(const ma_result &r) {
+   return uint8_t(int(r.termination) << 5 | (r.iterations < 31 ? r.iterations : 31));
+}
+
 using progress_callback = std::function<void(size_t progress)>;
 
-void compute_masb_points(ma_parameters &input_parameters, ma_data &madata, progress_callback callback = {});
+// Called by the thread that processes a chunk of spatially coherent points, with the indices of those
+// points, right before their balls are shrunk. Used to compute per point inputs (such as the normals)
+// while the neighbourhood of the chunk is in cache.
+using chunk_callback = std::function<void(const std::vector<int> &points)>;
+
+// Returns the total number of shrinking iterations (nearest neighbour queries) of the interior and exterior balls.
+// If madata.ma_termination has the size of madata.ma_qidx, the iterations and the termination of every ball are
+// stored in it (see pack_termination). If madata.stats is set, it receives their histogram (ma/iterations, by
+// the number of queries of the final shrinking of each ball) and a count per termination (ma/termination/...).
+size_t compute_masb_points(ma_parameters &input_parameters, ma_data &madata, progress_callback callback = {}, chunk_callback prepare = {});
+
+// Compute the MAT (without warm starting) with both the scalar and the packet kernel, and return the
+// number of balls for which the results are not bit-for-bit equal. madata holds the packet results.
+size_t compare_ma_kernels(ma_parameters &input_parameters, ma_data &madata);
+
+// Number of balls (of the 2N in madata) whose center, q index or radius is not bit-for-bit equal to the given arrays
+size_t count_ma_mismatches(const point_array &ma_coords, const std::vector<int> &ma_qidx, const std::vector<float> &ma_radius, const ma_data &madata);
+
+struct radius_estimate {
+   Scalar radius;               // the estimated initial radius
+   size_t pilot_balls;          // number of balls of the pilot run
+   double iterations_given;     // average number of iterations of the pilot balls from input_parameters.initial_radius
+   double iterations_estimated; // the same from the estimated radius of their region
+   size_t balls_differ;         // pilot balls whose result from the estimate differs from the one from initial_radius
+};
+
+// Estimates an initial radius per region for madata (which needs normals), for reporting only: the MAT is still
+// computed from input_parameters.initial_radius. The regions are the cells of a grid x grid grid over the xy extent
+// of the bounding box. The balls of pilot_points points spread over the input are shrunk from the diagonal of the
+// bounding box, and the estimate of a region is twice the largest of its resulting balls, at most the diagonal. The
+// pilot balls are then shrunk from initial_radius and from these estimates to compare both. regions receives the
+// estimates in row-major order; the returned estimate holds the largest radius and the totals of the pilot.
+// Builds madata.kd_tree if it is not set.
+radius_estimate estimate_initial_radius(const ma_parameters &input_parameters, ma_data &madata, std::vector<radius_estimate> &regions, int grid = 4, size_t pilot_points = 4096);
 
 #endif
@@ -21,6 +21,7 @@ SOFTWARE.
 */
 
 #include <iostream>
+#include <cstdio>
 #include <fstream>
 #include <string>
 
@@ -29,6 +30,7 @@ SOFTWARE.
 #include "compute_normals_processing.h"
 #include "io.h"
 #include "madata.h"
+#include "stats.h"
 #include "types.h"
 
 int main(int argc, char **argv) {
@@ -40,34 +42,63 @@ int main(int argc, char **argv) {
       TCLAP::UnlabeledValueArg<std::string> outputArg("output", "path to output directory. Estimated normals are written to the file 'normals.npy'.", false, "", "output dir", cmd);
 
       TCLAP::ValueArg<int> kArg("k", "kneighbours", "number of nearest neighbours to use for PCA", false, 10, "int", cmd);
+      std::vector<std::string> orientations = { "viewpoint", "mst" };
+      TCLAP::ValuesConstraint<std::string> orientationConstraint(orientations);
+      TCLAP::ValueArg<std::string> orientArg("o", "orient", "how to orient the normals: 'viewpoint' makes every normal face the viewpoint, 'mst' propagates a consistent orientation over the surface along a maximum spanning tree of the k-NN graph weighted by the agreement of the normals", false, "viewpoint", &orientationConstraint, cmd);
+      TCLAP::ValueArg<std::string> viewpointArg("", "viewpoint", "viewpoint for the 'viewpoint' orientation", false, "0,0,0", "x,y,z", cmd);
+      TCLAP::SwitchArg sensorSwitch("s", "sensor", "orient every normal towards the position of the sensor that recorded its point, read from the Nx3 float array 'viewpoints.npy' in the input directory", cmd, false);
+      TCLAP::SwitchArg graphSwitch("g", "graph", "cache the k-NN graph in 'knn_*.npy' files: read it from the input directory if it is there (and has enough neighbours), otherwise write it to the output directory", cmd, false);
+      TCLAP::SwitchArg sortSwitch("", "sort", "sort the points along a Morton curve before processing, for better cache locality; the output is written in input order", cmd, false);
+      TCLAP::ValueArg<std::string> statsArg("", "stats-json", "write the stage timings, counters and peak memory use of the run to this JSON file", false, "", "file", cmd);
 
       cmd.parse(argc, argv);
 
       normals_parameters normal_params;
       normal_params.k = kArg.getValue();
+      normal_params.orientation = orientArg.getValue() == "mst" ? normal_orientation::mst : normal_orientation::viewpoint;
+      if (std::sscanf(viewpointArg.getValue().c_str(), "%f,%f,%f", &normal_params.viewpoint[0], &normal_params.viewpoint[1], &normal_params.viewpoint[2]) != 3)
+         throw TCLAP::ArgParseException("expected x,y,z", viewpointArg.getValue());
 
       std::string output_path = outputArg.isSet() ? outputArg.getValue() : inputArg.getValue();
 
-      std::cout << "Parameters: k=" << normal_params.k << std::endl;
+      std::cout << "Parameters: k=" << normal_params.k << ", orient=" << orientArg.getValue() << std::endl;
 
       io_parameters io_params = {};
       io_params.coords = true;
+      io_params.viewpoints = sensorSwitch.getValue();
+      bool graph_cached = graphSwitch.getValue() && npy_exists(inputArg.getValue() + "/knn_offsets.npy");
+      io_params.coords_knn = graph_cached;
 
+      // the stages are printed as they finish
       ma_data madata = {};
+      std::shared_ptr<stats_recorder> stats(new stats_recorder(&std::cout));
+      madata.stats = stats;
       npy2madata(inputArg.getValue(), madata, io_params);
+      if (graphSwitch.getValue() && !madata.coords_knn)
+         madata.coords_knn.reset(new neighbour_graph);
+      if (sortSwitch.getValue())
+         sort_spatially(madata);
 
       std::cout << "Point count: " << madata.coords->size() << std::endl;
 
+      // a cached graph with too few neighbours is searched again, and written again
+      bool graph_reused = graph_cached && madata.coords_knn->covers(madata.coords->size(), normal_params.k + 1);
+
       // Perform the actual processing
-      madata.normals.reset(new NormalCloud);
+      madata.normals.reset(new point_array);
       compute_normals(normal_params, madata);
 
       io_params.coords = false;
       io_params.normals = true;
+      io_params.viewpoints = false;
+      io_params.coords_knn = graphSwitch.getValue() && !graph_reused;
       madata2npy(output_path, madata, io_params);
 
       // For convenience, convert the input .npy to .xyz
       convertNPYtoXYZ(inputArg.getValue());
+
+      if (statsArg.isSet())
+         stats->write_json(statsArg.getValue());
    }
    catch (TCLAP::ArgException &e) { std::cerr << "Error: " << e.error() << " for " << e.argId() << std::endl; }
 
@@ -21,59 +21,435 @@ SOFTWARE.
 */
 
 #include "compute_normals_processing.h"
+#include "kdtree.h"
+#include "parallel.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <limits>
+#include <queue>
+#include <unordered_map>
 
-#ifdef VERBOSEPRINT
-#include <chrono>
-#include <iostream>
-#endif
+#include <Eigen/Eigenvalues>
 
-#include <pcl/features/normal_3d_omp.h>
+//==============================
+//   COMPUTE NORMALS
+//==============================
+
+// Number of neighbourhoods whose eigenvectors are computed at once, as in the packet kernel of compute_ma
+const int normal_packet_size = 16;
+
+struct normal_packet {
+   // Upper triangle of the covariance matrices in structure-of-arrays layout
+   Scalar xx[normal_packet_size], xy[normal_packet_size], xz[normal_packet_size];
+   Scalar yy[normal_packet_size], yz[normal_packet_size], zz[normal_packet_size];
+
+   // Outputs of smallest_eigenvectors
+   Scalar nx[normal_packet_size], ny[normal_packet_size], nz[normal_packet_size];
+   int degenerate[normal_packet_size];
+};
+
+// Lanes whose two smallest eigenvalues are closer than this fraction of the trace are solved again in double
+// precision with Eigen's SelfAdjointEigenSolver. Below it the closed-form eigenvector loses accuracy in float:
+// on nearly collinear neighbourhoods it was up to 90 degrees off a double-precision solve. Ordinary surfaces
+// have few such lanes.
+const Scalar eigenvalue_gap_threshold = 0.01f;
+
+// Closed-form eigenvector of the smallest eigenvalue of every covariance matrix in the packet. The
+// eigenvalue follows from the trigonometric solution of the characteristic polynomial, the eigenvector is
+// the largest cross product of two rows of (A - lambda I). Lanes for which this is ill-conditioned (the two
+// smallest eigenvalues nearly equal, see eigenvalue_gap_threshold) are flagged as degenerate.
+MASB_TARGET_CLONES
+void smallest_eigenvectors(normal_packet &pk) {
+   for (int l = 0; l < normal_packet_size; l++) {
+      // scale to [-1, 1] to avoid over- and underflow
+      Scalar scale = std::max(std::max(std::max(std::abs(pk.xx[l]), std::abs(pk.xy[l])), std::max(std::abs(pk.xz[l]), std::abs(pk.yy[l]))),
+                              std::max(std::abs(pk.yz[l]), std::abs(pk.zz[l])));
+      Scalar inv_scale = scale > 0 ? 1 / scale : 0;
+      Scalar a00 = pk.xx[l] * inv_scale, a01 = pk.xy[l] * inv_scale, a02 = pk.xz[l] * inv_scale;
+      Scalar a11 = pk.yy[l] * inv_scale, a12 = pk.yz[l] * inv_scale, a22 = pk.zz[l] * inv_scale;
+
+      Scalar q = (a00 + a11 + a22) / 3;
+      Scalar b00 = a00 - q, b11 = a11 - q, b22 = a22 - q;
+      Scalar p1 = a01 * a01 + a02 * a02 + a12 * a12;
+      Scalar p2 = b00 * b00 + b11 * b11 + b22 * b22 + 2 * p1;
+      Scalar p = std::sqrt(std::max(p2, Scalar(1e-30f)) / 6);
+
+      // det((A - qI) / p) / 2 = cos(3 phi)
+      Scalar det = b00 * (b11 * b22 - a12 * a12) - a01 * (a01 * b22 - a12 * a02) + a02 * (a01 * a12 - b11 * a02);
+      Scalar r = std::min(std::max(det / (2 * p * p * p), Scalar(-1)), Scalar(1));
+      Scalar phi = std::acos(r) / 3;
+      Scalar lambda = q + 2 * p * std::cos(phi + Scalar(2 * M_PI / 3));
+      Scalar lambda_mid = 3 * q - (q + 2 * p * std::cos(phi)) - lambda;
+
+      Scalar r00 = a00 - lambda, r11 = a11 - lambda, r22 = a22 - lambda;
+      // cross products of the rows (r00 a01 a02), (a01 r11 a12) and (a02 a12 r22)
+      Scalar c0x = a01 * a12 - a02 * r11, c0y = a02 * a01 - r00 * a12, c0z = r00 * r11 - a01 * a01;
+      Scalar c1x = a01 * r22 - a02 * a12, c1y = a02 * a02 - r00 * r22, c1z = r00 * a12 - a01 * a02;
+      Scalar c2x = r11 * r22 - a12 * a12, c2y = a12 * a02 - a01 * r22, c2z = a01 * a12 - r11 * a02;
+      Scalar d0 = c0x * c0x + c0y * c0y + c0z * c0z;
+      Scalar d1 = c1x * c1x + c1y * c1y + c1z * c1z;
+      Scalar d2 = c2x * c2x + c2y * c2y + c2z * c2z;
+
+      Scalar cx = c0x, cy = c0y, cz = c0z, dmax = d0;
+      if (d1 > dmax) { cx = c1x; cy = c1y; cz = c1z; dmax = d1; }
+      if (d2 > dmax) { cx = c2x; cy = c2y; cz = c2z; dmax = d2; }
+
+      Scalar inv_norm = 1 / std::sqrt(std::max(dmax, Scalar(1e-30f)));
+      pk.nx[l] = cx * inv_norm;
+      pk.ny[l] = cy * inv_norm;
+      pk.nz[l] = cz * inv_norm;
+      pk.degenerate[l] = p2 < 1e-12f || dmax < 1e-12f || lambda_mid - lambda < eigenvalue_gap_threshold * 3 * q;
+   }
+}
 
-#ifdef VERBOSEPRINT
-typedef std::chrono::high_resolution_clock Clock;
-#endif
+void estimate_normals(const normals_parameters &input_parameters, ma_data &madata, const std::vector<int> &points) {
+   const point_array &cloud = *madata.coords;
+   point_array &normals = *madata.normals;
+   const int k = input_parameters.k;
+
+   // Take the neighbours from the cached graph, or search them and store them in a graph that is being filled
+   neighbour_graph *graph = madata.coords_knn.get();
+   const neighbour_graph *cached = graph && graph->covers(cloud.size(), k + 1) ? graph : nullptr;
+   neighbour_graph *filling = graph && !graph->complete() && graph->size() == cloud.size() ? graph : nullptr;
+   std::vector<int> indices(k + 1);
+   std::vector<Scalar> sqdists(k + 1);
+   bool valid[normal_packet_size];
+   normal_packet pk;
+   // the neighbours of every lane, for the lanes that are solved again in double precision
+   std::vector<int> lane_neighbours(normal_packet_size * (k + 1));
+   int lane_found[normal_packet_size];
+
+   for (size_t b = 0; b < points.size(); b += normal_packet_size) {
+      int lanes = int(std::min(points.size() - b, size_t(normal_packet_size)));
+
+      // Covariance of every neighbourhood around its centroid
+      for (int l = 0; l < normal_packet_size; l++) {
+         pk.xx[l] = pk.xy[l] = pk.xz[l] = pk.yy[l] = pk.yz[l] = pk.zz[l] = 0;
+         valid[l] = false;
+         if (l >= lanes)
+            continue;
+
+         const int *neighbours;
+         int i = points[b + l];
+         int found = find_neighbours(cached, madata.kd_tree.get(), i, cloud[i], k + 1, indices.data(), sqdists.data(), neighbours);
+         if (filling)
+            filling->set(i, found, neighbours, sqdists.data());
+         std::copy(neighbours, neighbours + found, &lane_neighbours[l * (k + 1)]);
+         lane_found[l] = found;
+         if (found < 3)
+            continue;
+
+         Scalar mx = 0, my = 0, mz = 0;
+         for (int j = 0; j < found; j++) {
+            mx += cloud.x[neighbours[j]];
+            my += cloud.y[neighbours[j]];
+            mz += cloud.z[neighbours[j]];
+         }
+         mx /= found; my /= found; mz /= found;
+         for (int j = 0; j < found; j++) {
+            Scalar dx = cloud.x[neighbours[j]] - mx, dy = cloud.y[neighbours[j]] - my, dz = cloud.z[neighbours[j]] - mz;
+            pk.xx[l] += dx * dx; pk.xy[l] += dx * dy; pk.xz[l] += dx * dz;
+            pk.yy[l] += dy * dy; pk.yz[l] += dy * dz; pk.zz[l] += dz * dz;
+         }
+         // no normal if all neighbours coincide
+         valid[l] = pk.xx[l] + pk.yy[l] + pk.zz[l] > 0;
+      }
+
+      smallest_eigenvectors(pk);
+
+      for (int l = 0; l < lanes; l++) {
+         int i = points[b + l];
+         Vector3 n(pk.nx[l], pk.ny[l], pk.nz[l]);
+         if (!valid[l]) {
+            n = Vector3::Constant(std::numeric_limits<Scalar>::quiet_NaN());
+         } else if (pk.degenerate[l]) {
+            // Nearly collinear or isotropic neighbourhood. The two smallest eigenvalues can be many orders of
+            // magnitude below the trace, which a float covariance doesn't resolve, so it is computed again in double.
+            const int *neighbours = &lane_neighbours[l * (k + 1)];
+            Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+            for (int j = 0; j < lane_found[l]; j++)
+               mean += cloud[neighbours[j]].transpose().cast<double>();
+            mean /= lane_found[l];
+            Eigen::Matrix3d covariance = Eigen::Matrix3d::Zero();
+            for (int j = 0; j < lane_found[l]; j++) {
+               Eigen::Vector3d d = cloud[neighbours[j]].transpose().cast<double>() - mean;
+               covariance += d * d.transpose();
+            }
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+            n = solver.eigenvectors().col(0).transpose().cast<Scalar>();
+         }
+
+         Vector3 viewpoint = madata.viewpoints ? (*madata.viewpoints)[i] : input_parameters.viewpoint;
+         if (n.dot(viewpoint - cloud[i]) < 0)
+            n = -n;
+         normals.set(i, n);
+      }
+   }
+}
 
 //==============================
-//   COMPUTE NORMALS
+//   ORIENT NORMALS
 //==============================
 
-void estimate_normals(ma_data &madata, int k) {
-   // Create the normal estimation class, and pass the input dataset to it
-   pcl::NormalEstimationOMP<Point, Normal> estimation;
-   estimation.setInputCloud(madata.coords);
+// Number of consecutive points (in Morton order) that are oriented as one block by orient_normals_mst
+const int orientation_block_size = 1 << 16;
 
-   // Create an empty kdtree representation, and pass it to the normal estimation object.
-   // Its content will be filled inside the object, based on the given input dataset (as no other search surface is given).
-   estimation.setSearchMethod(madata.kd_tree);
+struct tree_edge {
+   Scalar weight;
+   int point, parent;
+   bool operator<(const tree_edge &other) const { return weight < other.weight; }
+};
 
-   // Use all neighbors in a sphere of radius 3cm
-   estimation.setKSearch(k + 1);
+struct patch_edge {
+   double vote; // sum of n_i . n_j over the k-NN edges between the two patches
+   int a, b;
+};
 
-   // Compute the features
-   estimation.compute(*madata.normals);
+int find_root(std::vector<int> &parent, int a) {
+   while (parent[a] != a)
+      a = parent[a] = parent[parent[a]];
+   return a;
 }
 
-void compute_normals(normals_parameters &input_parameters, ma_data &madata) {
-#ifdef VERBOSEPRINT
-   auto start_time = Clock::now();
-#endif
-
-   if (!madata.kd_tree) {
-      madata.kd_tree.reset(new pcl::search::KdTree<Point>());
-      madata.kd_tree->setInputCloud(madata.coords);
-#ifdef VERBOSEPRINT
-      auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-      std::cout << "Constructed kd-tree in " << elapsed_time.count() << " ms" << std::endl;
-      start_time = Clock::now();
-#endif
+void orient_normals_mst(const normals_parameters &input_parameters, ma_data &madata) {
+   const point_array &coords = *madata.coords;
+   point_array &normals = *madata.normals;
+   const int k = input_parameters.k;
+   const int n = int(coords.size());
+   const neighbour_graph *graph = madata.coords_knn && madata.coords_knn->covers(n, k + 1) ? madata.coords_knn.get() : nullptr;
+   const int n_blocks = (n + orientation_block_size - 1) / orientation_block_size;
+
+   // Points that were sorted with sort_spatially are in Morton order already
+   std::vector<int> order, rank;
+   if (madata.order.empty()) {
+      order = spatial_order(coords);
+      rank = inverse_order(order);
    }
+   auto block_of = [&](int i) { return (rank.empty() ? i : rank[i]) / orientation_block_size; };
+
+   // 1. Propagate the orientation within every block with Prim's algorithm. Each part of a block that
+   // is connected in the k-NN graph becomes a patch. Points with a neighbour in another patch are marked.
+   std::vector<int> patch(n, -1);
+   std::vector<char> boundary(n, 0);
+   std::vector<int> patch_offset(n_blocks + 1, 0);
+   // The neighbours in other blocks are tested for finite normals while the threads of those blocks flip
+   // them, so the test reads a snapshot instead of the normals
+   std::vector<char> finite(n);
+#pragma omp parallel for
+   for (int i = 0; i < n; i++)
+      finite[i] = normals.is_finite(i);
+#pragma omp parallel
+   {
+      std::vector<int> indices(k + 1);
+      std::vector<Scalar> sqdists(k + 1);
+      std::priority_queue<tree_edge> heap;
 
-   estimate_normals(madata, input_parameters.k);
+#pragma omp for schedule(dynamic, 1)
+      for (int b = 0; b < n_blocks; b++) {
+         int n_patches = 0;
 
-#ifdef VERBOSEPRINT
-   auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-   std::cout << "Done estimating normals, took " << elapsed_time.count() << " ms" << std::endl;
-#endif
+         auto visit = [&](int i, int id) {
+            patch[i] = id;
+            Vector3 ni = normals[i];
+            const int *neighbours;
+            int found = find_neighbours(graph, madata.kd_tree.get(), i, coords[i], k + 1, indices.data(), sqdists.data(), neighbours);
+            for (int j = 0; j < found; j++) {
+               int q = neighbours[j];
+               if (q == i || !finite[q])
+                  continue;
+               if (block_of(q) != b || (patch[q] != -1 && patch[q] != id))
+                  boundary[i] = 1;
+               else if (patch[q] == -1)
+                  heap.push({ std::abs(ni.dot(normals[q])), q, i });
+            }
+         };
+
+         for (int r = b * orientation_block_size; r < std::min(n, (b + 1) * orientation_block_size); r++) {
+            int seed = order.empty() ? r : order[r];
+            if (patch[seed] != -1 || !finite[seed])
+               continue;
+            int id = n_patches++;
+            visit(seed, id);
+            while (!heap.empty()) {
+               tree_edge e = heap.top();
+               heap.pop();
+               if (patch[e.point] != -1)
+                  continue;
+               if (normals[e.point].dot(normals[e.parent]) < 0)
+                  normals.set(e.point, -normals[e.point]);
+               visit(e.point, id);
+            }
+         }
+         patch_offset[b + 1] = n_patches;
+      }
+   }
+
+   // Number the patches of all blocks consecutively
+   for (int b = 0; b < n_blocks; b++)
+      patch_offset[b + 1] += patch_offset[b];
+   const int n_patches = patch_offset[n_blocks];
+#pragma omp parallel for
+   for (int i = 0; i < n; i++)
+      if (patch[i] != -1)
+         patch[i] += patch_offset[block_of(i)];
+
+   // 2. Collect the votes between neighbouring patches, per block so that the sums don't depend on
+   // the number of threads. Also find the highest point of every patch.
+   std::vector<std::vector<patch_edge> > block_edges(n_blocks);
+   std::vector<int> top(n_patches, -1);
+#pragma omp parallel
+   {
+      std::vector<int> indices(k + 1);
+      std::vector<Scalar> sqdists(k + 1);
+      std::unordered_map<uint64_t, double> votes;
+
+#pragma omp for schedule(dynamic, 1)
+      for (int b = 0; b < n_blocks; b++) {
+         votes.clear();
+         for (int r = b * orientation_block_size; r < std::min(n, (b + 1) * orientation_block_size); r++) {
+            int i = order.empty() ? r : order[r];
+            int pi = patch[i];
+            if (pi == -1)
+               continue;
+            if (top[pi] == -1 || coords.z[i] > coords.z[top[pi]])
+               top[pi] = i;
+            if (!boundary[i])
+               continue;
+
+            Vector3 ni = normals[i];
+            const int *neighbours;
+            int found = find_neighbours(graph, madata.kd_tree.get(), i, coords[i], k + 1, indices.data(), sqdists.data(), neighbours);
+            for (int j = 0; j < found; j++) {
+               int pj = patch[neighbours[j]];
+               if (pj == -1 || pj == pi)
+                  continue;
+               Scalar dot = ni.dot(normals[neighbours[j]]);
+               if (pi < pj)
+                  votes[uint64_t(pi) << 32 | uint64_t(pj)] += dot;
+               else
+                  votes[uint64_t(pj) << 32 | uint64_t(pi)] += dot;
+            }
+         }
+         for (auto &v : votes)
+            block_edges[b].push_back({ v.second, int(v.first >> 32), int(v.first & 0xffffffff) });
+         std::sort(block_edges[b].begin(), block_edges[b].end(), [](const patch_edge &e1, const patch_edge &e2) {
+            return e1.a < e2.a || (e1.a == e2.a && e1.b < e2.b);
+         });
+      }
+   }
+
+   // Sum the votes of the blocks on both sides of an edge
+   std::unordered_map<uint64_t, double> votes;
+   for (int b = 0; b < n_blocks; b++) {
+      for (const patch_edge &e : block_edges[b])
+         votes[uint64_t(e.a) << 32 | uint64_t(e.b)] += e.vote;
+      std::vector<patch_edge>().swap(block_edges[b]);
+   }
+   std::vector<patch_edge> edges;
+   edges.reserve(votes.size());
+   for (auto &v : votes)
+      edges.push_back({ v.second, int(v.first >> 32), int(v.first & 0xffffffff) });
+   std::sort(edges.begin(), edges.end(), [](const patch_edge &e1, const patch_edge &e2) {
+      double w1 = std::abs(e1.vote), w2 = std::abs(e2.vote);
+      return w1 > w2 || (w1 == w2 && (e1.a < e2.a || (e1.a == e2.a && e1.b < e2.b)));
+   });
+
+   // 3. Maximum spanning tree of the patch graph (Kruskal), then propagate the flips from the patch with
+   // the highest point of every connected part
+   std::vector<int> parent(n_patches);
+   for (int p = 0; p < n_patches; p++)
+      parent[p] = p;
+   std::vector<std::vector<std::pair<int, bool> > > tree(n_patches);
+   for (const patch_edge &e : edges) {
+      int ra = find_root(parent, e.a), rb = find_root(parent, e.b);
+      if (ra == rb)
+         continue;
+      parent[ra] = rb;
+      tree[e.a].push_back(std::make_pair(e.b, e.vote < 0));
+      tree[e.b].push_back(std::make_pair(e.a, e.vote < 0));
+   }
+
+   std::vector<int> highest(n_patches, -1);
+   for (int p = 0; p < n_patches; p++) {
+      int r = find_root(parent, p);
+      if (highest[r] == -1 || coords.z[top[p]] > coords.z[top[highest[r]]])
+         highest[r] = p;
+   }
+
+   std::vector<char> flip(n_patches, 0), done(n_patches, 0);
+   std::vector<int> stack;
+   for (int r = 0; r < n_patches; r++) {
+      if (highest[r] == -1)
+         continue;
+      int start = highest[r];
+      flip[start] = normals.z[top[start]] < 0;
+      done[start] = 1;
+      stack.push_back(start);
+      while (!stack.empty()) {
+         int p = stack.back();
+         stack.pop_back();
+         for (const std::pair<int, bool> &child : tree[p]) {
+            if (done[child.first])
+               continue;
+            flip[child.first] = flip[p] != child.second;
+            done[child.first] = 1;
+            stack.push_back(child.first);
+         }
+      }
+   }
+
+#pragma omp parallel for
+   for (int i = 0; i < n; i++)
+      if (patch[i] != -1 && flip[patch[i]])
+         normals.set(i, -normals[i]);
+
+   if (madata.stats) {
+      madata.stats->count("normals/patches", n_patches);
+      madata.stats->count("normals/blocks", n_blocks);
+   }
+}
+
+void compute_normals(normals_parameters &input_parameters, ma_data &madata) {
+   stats_sink *stats = madata.stats.get();
+   stage_timer timer(stats, "normals/kd_tree");
+
+   // With a cached neighbour graph there is nothing to search
+   const int n_points = int(madata.coords->size());
+   neighbour_graph *graph = madata.coords_knn.get();
+   bool cached = graph && graph->covers(n_points, input_parameters.k + 1);
+   if (graph && !cached)
+      graph->start(n_points, input_parameters.k + 1);
+
+   if (!madata.kd_tree && !cached)
+      madata.kd_tree.reset(new kdtree(madata.coords));
+   timer.next("normals/estimate");
+
+   if (!madata.normals)
+      madata.normals.reset(new point_array);
+   madata.normals->resize(madata.coords->size());
+
+   const int n_chunks = (n_points + dynamic_chunk_size - 1) / dynamic_chunk_size;
+#pragma omp parallel
+   {
+      std::vector<int> chunk;
+      chunk.reserve(dynamic_chunk_size);
+#pragma omp for schedule(dynamic, 1)
+      for (int c = 0; c < n_chunks; c++) {
+         chunk.clear();
+         for (int i = c * dynamic_chunk_size; i < std::min(n_points, (c + 1) * dynamic_chunk_size); i++)
+            chunk.push_back(i);
+         estimate_normals(input_parameters, madata, chunk);
+      }
+   }
+   if (graph && !cached)
+      graph->finish();
+   if (stats)
+      stats->count("normals/kd_tree_queries", cached ? 0 : n_points);
+
+   if (input_parameters.orientation == normal_orientation::mst) {
+      timer.next("normals/orient");
+      orient_normals_mst(input_parameters, madata);
+   }
 }
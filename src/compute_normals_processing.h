@@ -25,10 +25,31 @@ SOFTWARE.
 
 #include "madata.h"
 
+enum class normal_orientation {
+   viewpoint, // every normal faces the viewpoint, or the sensor position of its point if madata has viewpoints
+   mst        // consistent over the surface, propagated along a maximum spanning tree of the k-NN graph, weighted by |n_i . n_j|
+};
+
 struct normals_parameters {
    int k;
+   normal_orientation orientation = normal_orientation::viewpoint;
+   Vector3 viewpoint = Vector3::Zero();
 };
 
+// Estimate the normal of every point from a PCA of the point and its k nearest neighbours, and orient
+// them. Uses (and otherwise builds) the kd-tree of madata.
 void compute_normals(normals_parameters &input_parameters, ma_data &madata);
 
+// Estimate the normals of the given points, as compute_normals does, facing the viewpoint. The normal is
+// NaN for points with fewer than 3 neighbours, or whose neighbours all coincide.
+void estimate_normals(const normals_parameters &input_parameters, ma_data &madata, const std::vector<int> &points);
+
+// Orient the normals of madata consistently over the surface (Hoppe et al. 1992). The points are split
+// into blocks of consecutive points in Morton order, and within each block the orientation is propagated
+// along a maximum spanning tree of the k-NN graph, weighted by |n_i . n_j|. This gives patches that are
+// consistent on their own, which are then flipped as a whole along a spanning tree of the patch
+// adjacency graph. The k-NN graph is never stored; the extra memory is about 10 bytes per point. Every
+// connected part ends up with the normal of its highest point facing up.
+void orient_normals_mst(const normals_parameters &input_parameters, ma_data &madata);
+
 #endif
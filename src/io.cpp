@@ -22,262 +22,786 @@ SOFTWARE.
 
 #include "io.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <typeinfo>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include <cnpy/cnpy.h>
 
 #include "madata.h"
+#include "parallel.h"
 #include "types.h"
 
-inline cnpy::NpyArray read_npyarray(std::string input_file_path) {
+inline void npy_seek(FILE *fp, size_t offset, int origin = SEEK_SET) {
+#ifdef _WIN32
+   _fseeki64(fp, offset, origin);
+#else
+   fseeko(fp, offset, origin);
+#endif
+}
+
+inline size_t npy_tell(FILE *fp) {
+#ifdef _WIN32
+   return _ftelli64(fp);
+#else
+   return ftello(fp);
+#endif
+}
+
+// Number of rows that is converted and written at a time
+const size_t npy_chunk_rows = 1 << 16;
+
+// The .npy header with 64-bit shapes, cnpy stores them as unsigned int
+template <typename T> std::vector<char> npy_header(size_t rows, size_t cols) {
+   std::ostringstream dict;
+   dict << "{'descr': '" << cnpy::BigEndianTest() << cnpy::map_type(typeid(T)) << sizeof(T)
+      << "', 'fortran_order': False, 'shape': (" << rows;
+   if (cols > 1)
+      dict << ", " << cols;
+   else
+      dict << ",";
+   dict << "), }";
+   std::string str = dict.str();
+   // pad with spaces so that the rows start at a multiple of 64 bytes, the header ends with a newline
+   str.append((64 - (11 + str.size()) % 64) % 64, ' ');
+   str += '\n';
+
+   std::vector<char> header;
+   header.push_back(char(0x93));
+   header.insert(header.end(), { 'N', 'U', 'M', 'P', 'Y', 1, 0 });
+   header.push_back(char(str.size() & 0xff));
+   header.push_back(char(str.size() >> 8));
+   header.insert(header.end(), str.begin(), str.end());
+   return header;
+}
+
+bool parse_npy_header(FILE *fp, size_t &word_size, std::vector<size_t> &shape, bool &fortran_order) {
+   // Version 1.0 headers have a 2 byte length, 2.0 and 3.0 a 4 byte length
+   unsigned char preamble[12];
+   if (fread(preamble, 1, 10, fp) != 10 || preamble[0] != 0x93 || std::string((char *)preamble + 1, 5) != "NUMPY")
+      return false;
+   size_t length = preamble[8] | size_t(preamble[9]) << 8;
+   if (preamble[6] >= 2) {
+      if (fread(preamble + 10, 1, 2, fp) != 2)
+         return false;
+      length |= size_t(preamble[10]) << 16 | size_t(preamble[11]) << 24;
+   }
+   std::string header(length, ' ');
+   if (fread(&header[0], 1, length, fp) != length)
+      return false;
+
+   size_t loc = header.find("fortran_order");
+   fortran_order = loc != std::string::npos && header.compare(header.find(':', loc) + 1, 5, " True") == 0;
+
+   // descr is the byte order, the type and the word size, for example '<f4'
+   loc = header.find("descr");
+   if (loc == std::string::npos)
+      return false;
+   loc = header.find('\'', header.find(':', loc));
+   if (loc == std::string::npos || header[loc + 1] == '>')
+      return false;
+   word_size = std::strtoull(header.c_str() + loc + 3, NULL, 10);
+
+   size_t begin = header.find('('), end = header.find(')');
+   if (begin == std::string::npos || end == std::string::npos)
+      return false;
+   shape.clear();
+   std::istringstream dims(header.substr(begin + 1, end - begin - 1));
+   std::string dim;
+   while (std::getline(dims, dim, ','))
+      if (dim.find_first_not_of(' ') != std::string::npos)
+         shape.push_back(std::strtoull(dim.c_str(), NULL, 10));
+   return true;
+}
+
+npy_map npy_mmap(std::string path) {
    // windows fix
-   std::replace(input_file_path.begin(), input_file_path.end(), '\\', '/');
-   // check if file exists
-   {
-      std::ifstream infile(input_file_path.c_str());
-      if (!infile) {
-         std::cerr << "Invalid file path " << input_file_path << std::endl;
-         exit(1);
-      }
+   std::replace(path.begin(), path.end(), '\\', '/');
+   FILE *fp = fopen(path.c_str(), "rb");
+   if (!fp) {
+      std::cerr << "Invalid file path " << path << std::endl;
+      exit(1);
+   }
+
+   npy_map map = {};
+   std::vector<size_t> shape;
+   bool fortran_order;
+   if (!parse_npy_header(fp, map.word_size, shape, fortran_order)) {
+      std::cerr << "Invalid .npy file " << path << std::endl;
+      exit(1);
    }
-   // std::cout << "Reading array from " << input_file_path <<std::endl;
-   cnpy::NpyArray npy_array = cnpy::npy_load(input_file_path.c_str());
-   return npy_array;
+   map.rows = shape.size() > 0 ? shape[0] : 1;
+   map.cols = 1;
+   for (size_t i = 1; i < shape.size(); i++)
+      map.cols *= shape[i];
+
+   size_t data_offset = npy_tell(fp);
+   npy_seek(fp, 0, SEEK_END);
+   size_t file_size = npy_tell(fp);
+   fclose(fp);
+
+   map.length = data_offset + map.rows * map.cols * map.word_size;
+   if (fortran_order || file_size < map.length) {
+      std::cerr << "Invalid .npy file " << path << std::endl;
+      exit(1);
+   }
+
+#ifdef _WIN32
+   HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+   map.base = mapping ? (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+   if (mapping) CloseHandle(mapping);
+   CloseHandle(file);
+#else
+   int fd = open(path.c_str(), O_RDONLY);
+   void *base = mmap(NULL, map.length, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   map.base = base == MAP_FAILED ? NULL : (const char *)base;
+   // all readers walk the rows front to back, let the kernel read ahead
+   if (map.base)
+      madvise(base, map.length, MADV_SEQUENTIAL);
+#endif
+   if (!map.base) {
+      std::cerr << "Failed to map " << path << std::endl;
+      exit(1);
+   }
+   map.data = map.base + data_offset;
+   return map;
+}
+
+size_t npy_unmap(npy_map &map) {
+#ifdef _WIN32
+   UnmapViewOfFile(map.base);
+#else
+   munmap((void *)map.base, map.length);
+#endif
+   map.base = NULL;
+   map.data = NULL;
+   return map.length;
+}
+
+void npy_release(const npy_map &map, size_t first, size_t count) {
+#ifndef _WIN32
+   // only the pages that lie entirely within the rows, the base of the mapping is page aligned
+   size_t page = size_t(sysconf(_SC_PAGESIZE));
+   size_t row_size = map.cols * map.word_size;
+   size_t begin = size_t(map.data - map.base) + first * row_size, end = begin + count * row_size;
+   begin = (begin + page - 1) / page * page;
+   end = end / page * page;
+   if (begin < end)
+      madvise((void *)(map.base + begin), end - begin, MADV_DONTNEED);
+#endif
+}
+
+inline npy_map map_array(std::string path, size_t word_size, size_t cols) {
+   npy_map map = npy_mmap(path);
+   if (map.word_size != word_size || map.cols != cols) {
+      std::cerr << "Unexpected array type or shape in " << path << std::endl;
+      exit(1);
+   }
+   return map;
+}
+
+inline void copy_points(const npy_map &map, point_array &points, size_t offset) {
+   // the .npy rows are interleaved x, y, z, split them into the coordinate arrays
+   ArrayX3View view = npy_view3(map);
+   for (size_t first = 0; first < map.rows; first += npy_copy_rows) {
+      size_t count = std::min(npy_copy_rows, map.rows - first);
+#pragma omp parallel for
+      for (long long i = first; i < (long long)(first + count); i++)
+         points.set(offset + i, view(i, 0), view(i, 1), view(i, 2));
+      npy_release(map, first, count);
+   }
+}
+
+template <typename T> inline void copy_rows(const npy_map &map, T *out) {
+   const T *rows = npy_rows<T>(map);
+   size_t cols = map.cols;
+   for (size_t first = 0; first < map.rows; first += npy_copy_rows) {
+      size_t count = std::min(npy_copy_rows, map.rows - first);
+      std::copy(rows + first * cols, rows + (first + count) * cols, out + first * cols);
+      npy_release(map, first, count);
+   }
+}
+
+// A neighbour graph is stored as three 1D arrays: prefix_offsets.npy (int64), prefix_indices.npy and prefix_sqdists.npy
+inline size_t load_graph(std::string prefix, neighbour_graph &graph) {
+   npy_map offsets = map_array(prefix + "_offsets.npy", sizeof(int64_t), 1);
+   npy_map indices = map_array(prefix + "_indices.npy", sizeof(int), 1);
+   npy_map sqdists = map_array(prefix + "_sqdists.npy", sizeof(float), 1);
+   const int64_t *first = npy_rows<int64_t>(offsets);
+   if (offsets.rows == 0 || first[offsets.rows - 1] != int64_t(indices.rows) || indices.rows != sqdists.rows) {
+      std::cerr << "Inconsistent neighbour graph " << prefix << std::endl;
+      exit(1);
+   }
+
+   graph.offsets.resize(offsets.rows);
+   graph.indices.resize(indices.rows);
+   graph.sqdists.resize(sqdists.rows);
+   copy_rows(offsets, graph.offsets.data());
+   copy_rows(indices, graph.indices.data());
+   copy_rows(sqdists, graph.sqdists.data());
+   int k = 0;
+   for (size_t i = 0; i < graph.size(); i++)
+      k = std::max(k, graph.count(i));
+   graph.assign_complete(k);
+   return npy_unmap(offsets) + npy_unmap(indices) + npy_unmap(sqdists);
 }
 
 void npy2madata(std::string input_dir_path, ma_data &madata, io_parameters &params) {
+   stage_timer timer(madata.stats.get(), "io/read");
+   size_t bytes_read = 0;
+
    if (params.coords) {
       std::cout << "Reading coords array..." << std::endl;
 
-      cnpy::NpyArray npy_array = read_npyarray(input_dir_path + "/coords.npy");
-      float* coords_carray = reinterpret_cast<float*>(npy_array.data);
-
-      madata.coords.reset(new PointCloud);
-      madata.coords->reserve(npy_array.shape[0]);
-
-      for (size_t i = 0; i < npy_array.shape[0]; i++)
-         madata.coords->push_back(Point(
-            coords_carray[i * 3 + 0],
-            coords_carray[i * 3 + 1],
-            coords_carray[i * 3 + 2]
-         ));
-      npy_array.destruct();
+      npy_map map = map_array(input_dir_path + "/coords.npy", sizeof(float), 3);
+      madata.coords.reset(new point_array);
+      madata.coords->resize(map.rows);
+      copy_points(map, *madata.coords, 0);
+      bytes_read += npy_unmap(map);
    }
 
    if (params.normals) {
       std::cout << "Reading normals array..." << std::endl;
 
-      cnpy::NpyArray npy_array = read_npyarray(input_dir_path + "/normals.npy");
-      float* normals_carray = reinterpret_cast<float*>(npy_array.data);
-
-      if (npy_array.shape[0] != madata.coords->size()) {
+      npy_map map = map_array(input_dir_path + "/normals.npy", sizeof(float), 3);
+      if (map.rows != madata.coords->size()) {
          std::cerr << "Mismatched number of coords and normals" << std::endl;
          exit(1);
       }
 
-      madata.normals.reset(new NormalCloud);
-      madata.normals->reserve(madata.coords->size());
+      madata.normals.reset(new point_array);
+      madata.normals->resize(map.rows);
+      copy_points(map, *madata.normals, 0);
+      bytes_read += npy_unmap(map);
+   }
+
+   if (params.viewpoints) {
+      std::cout << "Reading viewpoints array..." << std::endl;
 
-      for (size_t i = 0; i < madata.coords->size(); i++)
-         madata.normals->push_back(Normal(
-            normals_carray[i * 3 + 0],
-            normals_carray[i * 3 + 1],
-            normals_carray[i * 3 + 2]
-         ));
-      npy_array.destruct();
+      npy_map map = map_array(input_dir_path + "/viewpoints.npy", sizeof(float), 3);
+      if (map.rows != madata.coords->size()) {
+         std::cerr << "Mismatched number of coords and viewpoints" << std::endl;
+         exit(1);
+      }
+
+      madata.viewpoints.reset(new point_array);
+      madata.viewpoints->resize(map.rows);
+      copy_points(map, *madata.viewpoints, 0);
+      bytes_read += npy_unmap(map);
+   }
+
+   if (params.coords_knn) {
+      std::cout << "Reading neighbour graph..." << std::endl;
+
+      madata.coords_knn.reset(new neighbour_graph);
+      bytes_read += load_graph(input_dir_path + "/knn", *madata.coords_knn);
+      if (madata.coords_knn->size() != madata.coords->size()) {
+         std::cerr << "Mismatched number of coords and neighbour graph rows" << std::endl;
+         exit(1);
+      }
    }
 
    if (params.ma_coords) {
       std::cout << "Reading ma coords arrays..." << std::endl;
 
-      cnpy::NpyArray in_npy_array = read_npyarray(input_dir_path + "/ma_coords_in.npy");
-      float* in_ma_coords_carray = reinterpret_cast<float*>(in_npy_array.data);
-
-      if (in_npy_array.shape[0] != madata.coords->size()) {
+      npy_map in_map = map_array(input_dir_path + "/ma_coords_in.npy", sizeof(float), 3);
+      if (in_map.rows != madata.coords->size()) {
          std::cerr << "Mismatched number of coords and inner ma coords" << std::endl;
          exit(1);
       }
 
-      cnpy::NpyArray out_npy_array = read_npyarray(input_dir_path + "/ma_coords_out.npy");
-      float* out_ma_coords_carray = reinterpret_cast<float*>(out_npy_array.data);
-
-      if (out_npy_array.shape[0] != madata.coords->size()) {
+      npy_map out_map = map_array(input_dir_path + "/ma_coords_out.npy", sizeof(float), 3);
+      if (out_map.rows != madata.coords->size()) {
          std::cerr << "Mismatched number of coords and outer ma coords" << std::endl;
          exit(1);
       }
 
-      madata.ma_coords.reset(new PointCloud);
-      madata.ma_coords->reserve(2 * madata.coords->size());
-
-      for (size_t i = 0; i < madata.coords->size(); i++)
-         madata.ma_coords->push_back(Point(
-            in_ma_coords_carray[i * 3 + 0],
-            in_ma_coords_carray[i * 3 + 1],
-            in_ma_coords_carray[i * 3 + 2]
-         ));
-      in_npy_array.destruct();
-
-      for (size_t i = 0; i < madata.coords->size(); i++)
-         madata.ma_coords->push_back(Point(
-            out_ma_coords_carray[i * 3 + 0],
-            out_ma_coords_carray[i * 3 + 1],
-            out_ma_coords_carray[i * 3 + 2]
-         ));
-      out_npy_array.destruct();
+      madata.ma_coords.reset(new point_array);
+      madata.ma_coords->resize(2 * madata.coords->size());
+      copy_points(in_map, *madata.ma_coords, 0);
+      copy_points(out_map, *madata.ma_coords, madata.coords->size());
+      bytes_read += npy_unmap(in_map);
+      bytes_read += npy_unmap(out_map);
    }
 
    if (params.ma_qidx) {
       std::cout << "Reading q index arrays..." << std::endl;
 
-      cnpy::NpyArray in_npy_array = read_npyarray(input_dir_path + "/ma_qidx_in.npy");
-      int* in_qidx_carray = reinterpret_cast<int*>(in_npy_array.data);
-
-      if (in_npy_array.shape[0] != madata.coords->size()) {
+      npy_map in_map = map_array(input_dir_path + "/ma_qidx_in.npy", sizeof(int), 1);
+      if (in_map.rows != madata.coords->size()) {
          std::cerr << "Mismatched number of coords and inner q indices" << std::endl;
          exit(1);
       }
 
-      cnpy::NpyArray out_npy_array = read_npyarray(input_dir_path + "/ma_qidx_out.npy");
-      int* out_qidx_carray = reinterpret_cast<int*>(out_npy_array.data);
-
-      if (out_npy_array.shape[0] != madata.coords->size()) {
+      npy_map out_map = map_array(input_dir_path + "/ma_qidx_out.npy", sizeof(int), 1);
+      if (out_map.rows != madata.coords->size()) {
          std::cerr << "Mismatched number of coords and outer q indices" << std::endl;
          exit(1);
       }
 
-      madata.ma_qidx.reserve(2 * madata.coords->size());
+      madata.ma_qidx.resize(in_map.rows + out_map.rows);
+      copy_rows(in_map, madata.ma_qidx.data());
+      copy_rows(out_map, madata.ma_qidx.data() + in_map.rows);
+      bytes_read += npy_unmap(in_map);
+      bytes_read += npy_unmap(out_map);
+   }
+
+   if (params.ma_radius) {
+      std::cout << "Reading ma radius arrays..." << std::endl;
 
-      for (size_t i = 0; i < madata.coords->size(); i++)
-         madata.ma_qidx.push_back(in_qidx_carray[i]);
-      in_npy_array.destruct();
+      npy_map in_map = map_array(input_dir_path + "/ma_radius_in.npy", sizeof(float), 1);
+      if (in_map.rows != madata.coords->size()) {
+         std::cerr << "Mismatched number of coords and inner ma radii" << std::endl;
+         exit(1);
+      }
 
-      for (size_t i = 0; i < madata.coords->size(); i++)
-         madata.ma_qidx.push_back(out_qidx_carray[i]);
-      out_npy_array.destruct();
+      npy_map out_map = map_array(input_dir_path + "/ma_radius_out.npy", sizeof(float), 1);
+      if (out_map.rows != madata.coords->size()) {
+         std::cerr << "Mismatched number of coords and outer ma radii" << std::endl;
+         exit(1);
+      }
+
+      madata.ma_radius.resize(in_map.rows + out_map.rows);
+      copy_rows(in_map, madata.ma_radius.data());
+      copy_rows(out_map, madata.ma_radius.data() + in_map.rows);
+      bytes_read += npy_unmap(in_map);
+      bytes_read += npy_unmap(out_map);
+   }
+
+   if (params.ma_knn) {
+      std::cout << "Reading ma neighbour graph..." << std::endl;
+
+      madata.ma_knn.reset(new neighbour_graph);
+      bytes_read += load_graph(input_dir_path + "/ma_knn", *madata.ma_knn);
+   }
+
+   if (params.ma_bisec_cos) {
+      std::cout << "Reading bisector angle array..." << std::endl;
+
+      // one row per MA point and one column per number of neighbours, stored column by column in ma_data
+      npy_map map = npy_mmap(input_dir_path + "/ma_bisec_cos.npy");
+      size_t N = madata.coords->size();
+      if (map.word_size != sizeof(float) || map.cols == 0 || (map.rows != N && map.rows != 2 * N)) {
+         std::cerr << "Mismatched number of coords and bisector angles" << std::endl;
+         exit(1);
+      }
+
+      // a cache of other MA points (e.g. from before compute_ma was rerun) is dropped, simplify then recomputes it
+      madata.ma_bisec_fingerprint = 0;
+      if (npy_exists(input_dir_path + "/ma_bisec_fingerprint.npy")) {
+         npy_map fingerprint = npy_mmap(input_dir_path + "/ma_bisec_fingerprint.npy");
+         if (fingerprint.word_size == sizeof(uint64_t) && fingerprint.rows * fingerprint.cols == 1)
+            madata.ma_bisec_fingerprint = *npy_rows<uint64_t>(fingerprint);
+         bytes_read += npy_unmap(fingerprint);
+      }
+      bool stale = madata.ma_coords && madata.ma_qidx.size() >= map.rows && madata.ma_bisec_fingerprint != ma_fingerprint(madata, map.rows);
+      if (stale) {
+         std::cout << "Bisector angle array does not match the MA points, ignoring it" << std::endl;
+         madata.ma_bisec_cos.clear();
+         madata.ma_bisec_k = 0;
+      } else {
+         const float *rows = npy_rows<float>(map);
+         madata.ma_bisec_k = int(map.cols);
+         madata.ma_bisec_cos.resize(map.rows * map.cols);
+         for (size_t first = 0; first < map.rows; first += npy_copy_rows) {
+            size_t count = std::min(npy_copy_rows, map.rows - first);
+#pragma omp parallel for
+            for (long long i = first; i < (long long)(first + count); i++)
+               for (size_t j = 0; j < map.cols; j++)
+                  madata.ma_bisec_cos[j * map.rows + i] = rows[i * map.cols + j];
+            npy_release(map, first, count);
+         }
+      }
+      bytes_read += npy_unmap(map);
    }
 
    if (params.lfs) {
       std::cout << "Reading lfs array..." << std::endl;
 
-      cnpy::NpyArray npy_array = read_npyarray(input_dir_path + "/lfs.npy");
-      float* lfs_carray = reinterpret_cast<float*>(npy_array.data);
-
-      if (npy_array.shape[0] != madata.coords->size()) {
+      npy_map map = map_array(input_dir_path + "/lfs.npy", sizeof(float), 1);
+      if (map.rows != madata.coords->size()) {
          std::cerr << "Mismatched number of coords and lfs" << std::endl;
          exit(1);
       }
 
-      madata.lfs.reserve(madata.coords->size());
+      madata.lfs.resize(map.rows);
+      copy_rows(map, madata.lfs.data());
+      bytes_read += npy_unmap(map);
+   }
+
+   timer.stop();
+   if (madata.stats)
+      madata.stats->count("io/bytes_read", bytes_read);
+}
+
+template <typename T, typename Fill>
+size_t npy_save_chunked(std::string path, size_t rows, size_t cols, Fill fill) {
+   // Write the array through a buffer of npy_chunk_rows rows, fill(first, count, buffer)
+   // converts the rows [first, first + count) into the buffer
+   npy_file file = npy_create<T>(path, rows, cols);
+   std::unique_ptr<T[]> buffer(new T[std::min(rows, npy_chunk_rows) * cols]);
+   for (size_t first = 0; first < rows; first += npy_chunk_rows) {
+      size_t count = std::min(npy_chunk_rows, rows - first);
+      fill(first, count, buffer.get());
+      npy_write_rows(file, first, count, buffer.get());
+   }
+   return npy_close(file);
+}
+
+// The arrays of a spatially sorted madata are scattered back to input order while writing,
+// row r of a file is element offset + inverse[r] of the array
+
+inline size_t input_row(const std::vector<int> &inverse, size_t r) {
+   return inverse.empty() ? r : size_t(inverse[r]);
+}
+
+inline size_t save_points(std::string path, const point_array &points, size_t offset, size_t rows, const std::vector<int> &inverse) {
+   return npy_save_chunked<float>(path, rows, 3, [&](size_t first, size_t count, float *buffer) {
+      for (size_t i = 0; i < count; i++) {
+         size_t j = offset + input_row(inverse, first + i);
+         buffer[3 * i + 0] = points.x[j];
+         buffer[3 * i + 1] = points.y[j];
+         buffer[3 * i + 2] = points.z[j];
+      }
+   });
+}
+
+template <typename T> size_t save_vector(std::string path, const std::vector<T> &v, size_t offset, size_t rows, const std::vector<int> &inverse) {
+   if (!inverse.empty()) {
+      return npy_save_chunked<T>(path, rows, 1, [&](size_t first, size_t count, T *buffer) {
+         for (size_t i = 0; i < count; i++)
+            buffer[i] = v[offset + inverse[first + i]];
+      });
+   }
+   // the vector already holds the rows contiguously, write them without a copy
+   npy_file file = npy_create<T>(path, rows, 1);
+   if (rows > 0)
+      npy_write_rows(file, 0, rows, &v[offset]);
+   return npy_close(file);
+}
+
+inline size_t save_qidx(std::string path, const std::vector<int> &qidx, size_t offset, size_t rows, const std::vector<int> &order, const std::vector<int> &inverse) {
+   if (order.empty())
+      return save_vector(path, qidx, offset, rows, inverse);
+   // the q indices are positions in the sorted arrays, write them as input indices
+   return npy_save_chunked<int>(path, rows, 1, [&](size_t first, size_t count, int *buffer) {
+      for (size_t i = 0; i < count; i++) {
+         int q = qidx[offset + inverse[first + i]];
+         buffer[i] = q == -1 ? -1 : order[q];
+      }
+   });
+}
 
-      for (size_t i = 0; i < madata.coords->size(); i++)
-         madata.lfs.push_back(lfs_carray[i]);
-      npy_array.destruct();
+inline size_t save_graph(std::string prefix, const neighbour_graph &graph, const std::vector<int> &order, const std::vector<int> &inverse) {
+   // the rows and the neighbour indices of a sorted graph are written in input order
+   neighbour_graph unsorted;
+   const neighbour_graph *g = &graph;
+   if (!order.empty()) {
+      unsorted = reorder(graph, inverse, order);
+      g = &unsorted;
    }
+
+   npy_file offsets = npy_create<int64_t>(prefix + "_offsets.npy", g->offsets.size(), 1);
+   npy_write_rows(offsets, 0, g->offsets.size(), g->offsets.data());
+   return npy_close(offsets) +
+      save_vector(prefix + "_indices.npy", g->indices, 0, g->indices.size(), std::vector<int>()) +
+      save_vector(prefix + "_sqdists.npy", g->sqdists, 0, g->sqdists.size(), std::vector<int>());
 }
 
 void madata2npy(std::string npy_path, ma_data &madata, io_parameters &params) {
+   // Every array is streamed to its own file, the files are written in parallel. A writer returns the size of its files.
+   stage_timer timer(madata.stats.get(), "io/write");
+   std::vector<std::function<size_t()> > writers;
+   size_t N = madata.coords->size();
+   std::vector<int> inverse;
+   if (!madata.order.empty())
+      inverse = inverse_order(madata.order);
+
    if (params.coords) {
       std::cout << "Writing coords array..." << std::endl;
-
-      const unsigned int shape[] = { static_cast<unsigned int>(madata.coords->size()), 3 };
-      float* coords_carray = new float[madata.coords->size() * 3];
-      for (size_t i = 0; i < madata.coords->size(); i++) {
-         coords_carray[i * 3 + 0] = madata.coords->at(i).x;
-         coords_carray[i * 3 + 1] = madata.coords->at(i).y;
-         coords_carray[i * 3 + 2] = madata.coords->at(i).z;
-      }
-      cnpy::npy_save(npy_path + "/coords.npy", coords_carray, shape, 2, "w");
-      delete[] coords_carray; coords_carray = nullptr;
+      writers.push_back([&]() { return save_points(npy_path + "/coords.npy", *madata.coords, 0, N, inverse); });
    }
 
    if (params.normals) {
       std::cout << "Writing normals array..." << std::endl;
-
-      const unsigned int shape[] = { static_cast<unsigned int>(madata.coords->size()), 3 };
-      float* normals_carray = new float[madata.coords->size() * 3];
-      for (size_t i = 0; i < madata.coords->size(); i++) {
-         normals_carray[i * 3 + 0] = madata.normals->at(i).normal_x;
-         normals_carray[i * 3 + 1] = madata.normals->at(i).normal_y;
-         normals_carray[i * 3 + 2] = madata.normals->at(i).normal_z;
-      }
-      cnpy::npy_save(npy_path + "/normals.npy", normals_carray, shape, 2, "w");
-      delete[] normals_carray; normals_carray = nullptr;
+      writers.push_back([&]() { return save_points(npy_path + "/normals.npy", *madata.normals, 0, N, inverse); });
    }
 
    if (params.ma_coords) {
       std::cout << "Writing ma coords arrays..." << std::endl;
-
-      const unsigned int shape[] = { static_cast<unsigned int>(madata.coords->size()), 3 };
-
-      float* in_ma_coords_carray = new float[madata.coords->size() * 3];
-      for (size_t i = 0; i < madata.coords->size(); i++) {
-         in_ma_coords_carray[i * 3 + 0] = madata.ma_coords->at(i).x;
-         in_ma_coords_carray[i * 3 + 1] = madata.ma_coords->at(i).y;
-         in_ma_coords_carray[i * 3 + 2] = madata.ma_coords->at(i).z;
-      }
-      cnpy::npy_save(npy_path + "/ma_coords_in.npy", in_ma_coords_carray, shape, 2, "w");
-      delete[] in_ma_coords_carray; in_ma_coords_carray = nullptr;
-
-      float* out_ma_coords_carray = new float[madata.coords->size() * 3];
-      for (size_t i = 0; i < madata.coords->size(); i++) {
-         out_ma_coords_carray[i * 3 + 0] = madata.ma_coords->at(i + madata.coords->size()).x;
-         out_ma_coords_carray[i * 3 + 1] = madata.ma_coords->at(i + madata.coords->size()).y;
-         out_ma_coords_carray[i * 3 + 2] = madata.ma_coords->at(i + madata.coords->size()).z;
-      }
-      cnpy::npy_save(npy_path + "/ma_coords_out.npy", out_ma_coords_carray, shape, 2, "w");
-      delete[] out_ma_coords_carray; out_ma_coords_carray = nullptr;
+      writers.push_back([&]() { return save_points(npy_path + "/ma_coords_in.npy", *madata.ma_coords, 0, N, inverse); });
+      writers.push_back([&]() { return save_points(npy_path + "/ma_coords_out.npy", *madata.ma_coords, N, N, inverse); });
    }
 
    if (params.ma_qidx) {
       std::cout << "Writing q index arrays..." << std::endl;
-
-      const unsigned int shape[] = { static_cast<unsigned int>(madata.coords->size()) };
-
-      cnpy::npy_save(npy_path + "/ma_qidx_in.npy", &madata.ma_qidx[0], shape, 1, "w");
-      cnpy::npy_save(npy_path + "/ma_qidx_out.npy", &madata.ma_qidx[madata.coords->size()], shape, 1, "w");
+      writers.push_back([&]() { return save_qidx(npy_path + "/ma_qidx_in.npy", madata.ma_qidx, 0, N, madata.order, inverse); });
+      writers.push_back([&]() { return save_qidx(npy_path + "/ma_qidx_out.npy", madata.ma_qidx, N, N, madata.order, inverse); });
    }
 
    if (params.ma_radius) {
-	   std::cout << "Writing ma radius arrays..." << std::endl;
-	   const unsigned int shape[] = { static_cast<unsigned int>(madata.coords->size()) };
-
-	   cnpy::npy_save(npy_path + "/ma_radius_in.npy", &madata.ma_radius[0], shape, 1, "w");
-	   cnpy::npy_save(npy_path + "/ma_radius_out.npy", &madata.ma_radius[madata.coords->size()], shape, 1, "w");
+      std::cout << "Writing ma radius arrays..." << std::endl;
+      writers.push_back([&]() { return save_vector(npy_path + "/ma_radius_in.npy", madata.ma_radius, 0, N, inverse); });
+      writers.push_back([&]() { return save_vector(npy_path + "/ma_radius_out.npy", madata.ma_radius, N, N, inverse); });
    }
 
-   
+   if (params.ma_termination && madata.ma_termination.size() == 2 * N) {
+      std::cout << "Writing ma termination arrays..." << std::endl;
+      writers.push_back([&]() { return save_vector(npy_path + "/ma_termination_in.npy", madata.ma_termination, 0, N, inverse); });
+      writers.push_back([&]() { return save_vector(npy_path + "/ma_termination_out.npy", madata.ma_termination, N, N, inverse); });
+   }
 
    if (params.lfs) {
       std::cout << "Writing lfs array..." << std::endl;
-
-      const unsigned int shape[] = { static_cast<unsigned int>(madata.coords->size()) };
-      cnpy::npy_save(npy_path + "/lfs.npy", &madata.lfs[0], shape, 1, "w");
+      writers.push_back([&]() { return save_vector(npy_path + "/lfs.npy", madata.lfs, 0, N, inverse); });
    }
 
    if (params.mask) {
       std::cout << "Writing mask array..." << std::endl;
+      writers.push_back([&]() {
+         return npy_save_chunked<bool>(npy_path + "/decimate_lfs.npy", N, 1, [&](size_t first, size_t count, bool *buffer) {
+            for (size_t i = 0; i < count; i++)
+               buffer[i] = madata.mask[input_row(inverse, first + i)];
+         });
+      });
+   }
 
-      const unsigned int shape[] = { static_cast<unsigned int>(madata.coords->size()) };
-      bool* out_mask_carray = new bool[madata.coords->size()];
-      for (size_t i = 0; i < madata.coords->size(); i++) {
-         out_mask_carray[i] = madata.mask[i];
+   if (params.coords_knn && madata.coords_knn && madata.coords_knn->complete()) {
+      std::cout << "Writing neighbour graph..." << std::endl;
+      writers.push_back([&]() { return save_graph(npy_path + "/knn", *madata.coords_knn, madata.order, inverse); });
+   }
+
+   if (params.ma_knn && madata.ma_knn && madata.ma_knn->complete()) {
+      std::cout << "Writing ma neighbour graph..." << std::endl;
+      writers.push_back([&]() { return save_graph(npy_path + "/ma_knn", *madata.ma_knn, madata.order, inverse); });
+   }
+
+   if (params.ma_bisec_cos && !madata.ma_bisec_cos.empty()) {
+      std::cout << "Writing bisector angle array..." << std::endl;
+      writers.push_back([&]() {
+         size_t cols = madata.ma_bisec_k, rows = madata.ma_bisec_cos.size() / cols;
+         npy_file fingerprint = npy_create<uint64_t>(npy_path + "/ma_bisec_fingerprint.npy", 1, 1);
+         npy_write_rows(fingerprint, 0, 1, &madata.ma_bisec_fingerprint);
+         return npy_close(fingerprint) + npy_save_chunked<float>(npy_path + "/ma_bisec_cos.npy", rows, cols, [&](size_t first, size_t count, float *buffer) {
+            for (size_t i = 0; i < count; i++) {
+               // the inner and the outer MA points are sorted separately
+               size_t r = first + i, block = r / N * N;
+               size_t j = block + input_row(inverse, r - block);
+               for (size_t c = 0; c < cols; c++)
+                  buffer[i * cols + c] = madata.ma_bisec_cos[c * rows + j];
+            }
+         });
+      });
+   }
+
+   long long bytes_written = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:bytes_written)
+   for (int i = 0; i < int(writers.size()); i++)
+      bytes_written += writers[i]();
+   timer.stop();
+   if (madata.stats)
+      madata.stats->count("io/bytes_written", bytes_written);
+}
+
+template <typename T> npy_file npy_create(std::string path, size_t rows, size_t cols) {
+   std::replace(path.begin(), path.end(), '\\', '/');
+   npy_file file;
+   file.fp = fopen(path.c_str(), "w+b");
+   if (!file.fp) {
+      std::cerr << "Invalid file path " << path << std::endl;
+      exit(1);
+   }
+
+   std::vector<char> header = npy_header<T>(rows, cols);
+   fwrite(&header[0], sizeof(char), header.size(), file.fp);
+   file.rows = rows;
+   file.row_size = cols * sizeof(T);
+   file.data_offset = header.size();
+
+   // extend the file to its full size, the rows can then be written in any order
+   if (rows > 0) {
+      char zero = 0;
+      npy_seek(file.fp, file.data_offset + rows * file.row_size - 1);
+      fwrite(&zero, 1, 1, file.fp);
+   }
+   return file;
+}
+
+template npy_file npy_create<float>(std::string path, size_t rows, size_t cols);
+template npy_file npy_create<int>(std::string path, size_t rows, size_t cols);
+template npy_file npy_create<bool>(std::string path, size_t rows, size_t cols);
+template npy_file npy_create<int64_t>(std::string path, size_t rows, size_t cols);
+template npy_file npy_create<uint64_t>(std::string path, size_t rows, size_t cols);
+template npy_file npy_create<uint8_t>(std::string path, size_t rows, size_t cols);
+
+bool npy_exists(std::string path) {
+   std::replace(path.begin(), path.end(), '\\', '/');
+   return std::ifstream(path.c_str()).good();
+}
+
+void npy_write_rows(npy_file &file, size_t first, size_t count, const void *data) {
+   npy_seek(file.fp, file.data_offset + first * file.row_size);
+   if (fwrite(data, file.row_size, count, file.fp) != count) {
+      std::cerr << "Failed to write rows " << first << "-" << first + count << std::endl;
+      exit(1);
+   }
+}
+
+size_t npy_close(npy_file &file) {
+   fclose(file.fp);
+   file.fp = NULL;
+   return file.data_offset + file.rows * file.row_size;
+}
+
+// Appends rows first .. first + count - 1 of a file to out
+typedef std::function<void(size_t first, size_t count, std::string &out)> row_formatter;
+
+// Format the rows of a file in chunks of npy_chunk_rows, one chunk per thread at a time, and append the
+// chunks to the file in order
+inline size_t write_formatted(FILE *fp, std::string path, size_t rows, const row_formatter &format) {
+   int threads = thread_count();
+   size_t written = 0;
+   std::vector<std::string> chunks(threads);
+   for (size_t batch = 0; batch < rows; batch += threads * npy_chunk_rows) {
+#pragma omp parallel for schedule(static, 1)
+      for (int t = 0; t < threads; t++) {
+         chunks[t].clear();
+         size_t first = batch + t * npy_chunk_rows;
+         if (first < rows)
+            format(first, std::min(npy_chunk_rows, rows - first), chunks[t]);
+      }
+      for (int t = 0; t < threads; t++) {
+         if (fwrite(chunks[t].data(), 1, chunks[t].size(), fp) != chunks[t].size()) {
+            std::cerr << "Failed to write " << path << std::endl;
+            exit(1);
+         }
+         written += chunks[t].size();
       }
-      cnpy::npy_save(npy_path + "/decimate_lfs.npy", out_mask_carray, shape, 1, "w");
-      delete[] out_mask_carray; out_mask_carray = nullptr;
    }
+   return written;
+}
+
+inline FILE *open_output(std::string path) {
+   std::replace(path.begin(), path.end(), '\\', '/');
+   FILE *fp = fopen(path.c_str(), "wb");
+   if (!fp) {
+      std::cerr << "Invalid file path " << path << std::endl;
+      exit(1);
+   }
+   return fp;
+}
+
+void save_masked_ply(std::string path, const ma_data &madata) {
+   stage_timer timer(madata.stats.get(), "io/write");
+   const point_array &coords = *madata.coords;
+   size_t N = coords.size(), kept = 0;
+   for (size_t i = 0; i < N; i++)
+      kept += madata.mask[i] != 0;
+   std::vector<int> inverse;
+   if (!madata.order.empty())
+      inverse = inverse_order(madata.order);
+
+   FILE *fp = open_output(path);
+   std::ostringstream header;
+   header << "ply\nformat " << (cnpy::BigEndianTest() == '<' ? "binary_little_endian" : "binary_big_endian")
+      << " 1.0\nelement vertex " << kept << "\nproperty float x\nproperty float y\nproperty float z\nend_header\n";
+   std::string str = header.str();
+   fwrite(str.data(), 1, str.size(), fp);
+
+   size_t written = str.size() + write_formatted(fp, path, N, [&](size_t first, size_t count, std::string &out) {
+      for (size_t r = first; r < first + count; r++) {
+         size_t i = input_row(inverse, r);
+         if (!madata.mask[i]) continue;
+         float p[3] = { coords.x[i], coords.y[i], coords.z[i] };
+         out.append(reinterpret_cast<const char *>(p), sizeof(p));
+      }
+   });
+   fclose(fp);
+   timer.stop();
+   if (madata.stats)
+      madata.stats->count("io/bytes_written", written);
+}
+
+// Write v rounded to a fixed number of decimals (scale is 10^decimals), without the overhead of the locale
+// aware stream and printf formatting. Returns the end of the text.
+inline char *format_fixed(char *out, float v, int decimals, double scale) {
+   double x = std::abs(double(v) * scale);
+   if (!finite_bits(x) || x >= 1e18)
+      return out + sprintf(out, "%g", v); // nan and inf, and numbers that don't fit in 64 bits
+   uint64_t n = uint64_t(x + 0.5);
+   if (v < 0 && n != 0)
+      *out++ = '-';
+   char digits[24];
+   int len = 0;
+   do {
+      digits[len++] = char('0' + n % 10);
+      n /= 10;
+   } while (n != 0 || len <= decimals);
+   for (int d = len - 1; d >= 0; d--) {
+      *out++ = digits[d];
+      if (d == decimals && d > 0)
+         *out++ = '.';
+   }
+   return out;
+}
+
+void save_masked_xyz(std::string path, const ma_data &madata, int decimals) {
+   stage_timer timer(madata.stats.get(), "io/write");
+   const point_array &coords = *madata.coords;
+   size_t N = coords.size();
+   std::vector<int> inverse;
+   if (!madata.order.empty())
+      inverse = inverse_order(madata.order);
+   double scale = std::pow(10.0, decimals);
+
+   FILE *fp = open_output(path);
+   // many pointcloud xyz readers prefer a "header" line.
+   fputs("x y z\n", fp);
+   size_t written = 6 + write_formatted(fp, path, N, [&](size_t first, size_t count, std::string &out) {
+      char line[128];
+      for (size_t r = first; r < first + count; r++) {
+         size_t i = input_row(inverse, r);
+         if (!madata.mask[i]) continue;
+         char *end = format_fixed(line, coords.x[i], decimals, scale);
+         *end++ = ' ';
+         end = format_fixed(end, coords.y[i], decimals, scale);
+         *end++ = ' ';
+         end = format_fixed(end, coords.z[i], decimals, scale);
+         *end++ = '\n';
+         out.append(line, end);
+      }
+   });
+   fclose(fp);
+   timer.stop();
+   if (madata.stats)
+      madata.stats->count("io/bytes_written", written);
 }
 
 // Just a convenience function, to call when necessary.
 void convertNPYtoXYZ(std::string input_dir_path)
 {
    // Read in the data:
-   cnpy::NpyArray coords_npy = read_npyarray(input_dir_path + "/coords.npy");
-   float* coords_carray = reinterpret_cast<float*>(coords_npy.data);
-
-   unsigned int num_points = coords_npy.shape[0];
-   unsigned int dim = coords_npy.shape[1];
+   npy_map coords_npy = map_array(input_dir_path + "/coords.npy", sizeof(float), 3);
+   ArrayX3View coords = npy_view3(coords_npy);
 
    // Write this out to a pointcloudxyz file:
    std::string outFile(input_dir_path + "/coords.xyz");
@@ -292,14 +816,14 @@ void convertNPYtoXYZ(std::string input_dir_path)
    out_pointcloudxyz << "x y z\n";
 
    // coords
-   for (int i = 0; i < num_points; i++)
+   for (long long i = 0; i < coords.rows(); i++)
    {
       for (int j = 0; j < 3; j++)
       {
          if (j > 0) out_pointcloudxyz << " ";
-         out_pointcloudxyz << coords_carray[i * 3 + j];
+         out_pointcloudxyz << coords(i, j);
       }
       out_pointcloudxyz << "\n";
    }
-   coords_npy.destruct();
+   npy_unmap(coords_npy);
 }
@@ -23,25 +23,87 @@ SOFTWARE.
 #ifndef MASBCPP_IO_
 #define MASBCPP_IO_
 
+#include <cstdio>
 #include <iostream>
 #include <fstream>
 #include <string>
 
 #include "madata.h"
+#include "types.h"
 
 struct io_parameters {
    bool coords;
    bool normals;
+   bool viewpoints; // read only
    bool ma_coords;
    bool ma_qidx;
    bool ma_radius;
+   bool ma_termination; // write only
    bool lfs;
    bool mask;
+   bool coords_knn; // neighbour graph caches, see ma_data
+   bool ma_knn;
+   bool ma_bisec_cos; // cache of the bisector cleaning, see ma_data
 };
 
+// Both report their duration (stages io/read and io/write) and the size of the files (counters io/bytes_read
+// and io/bytes_written) to madata.stats, as do save_masked_ply and save_masked_xyz. npy2madata is a chunked
+// mmap reader: it maps every file and copies it into madata in chunks of npy_copy_rows rows.
 void npy2madata(std::string input_dir_path, ma_data &madata, io_parameters &p);
 void madata2npy(std::string npy_path, ma_data &madata, io_parameters &p);
 
+// Read-only memory mapped .npy file. Its rows can be read from the page cache without reading the whole file
+// into a buffer first, the readers copy them out in chunks (see npy_copy_rows).
+struct npy_map {
+   const char *base;    // start of the mapping
+   size_t length;       // bytes mapped
+   const char *data;    // first row
+   size_t rows;
+   size_t cols;         // product of all but the first dimension
+   size_t word_size;
+};
+
+npy_map npy_mmap(std::string path);
+size_t npy_unmap(npy_map &map); // returns the number of bytes that were mapped
+
+// Drops the resident pages of the rows [first, first + count) of a mapping, after they have been copied or used.
+// The pages are read from the file again if the rows are accessed later.
+void npy_release(const npy_map &map, size_t first, size_t count);
+
+// Rows copied out of a mapping before their pages are released, so that a mapped file and its copy are not both
+// resident. This is not zero-copy: the processing works on the copies, in the layout of point_array.
+const size_t npy_copy_rows = 1 << 20;
+
+typedef Eigen::Map<const ArrayX3> ArrayX3View;
+
+inline ArrayX3View npy_view3(const npy_map &map) {
+   return ArrayX3View(reinterpret_cast<const Scalar *>(map.data), map.rows, 3);
+}
+
+template <typename T> inline const T *npy_rows(const npy_map &map) {
+   return reinterpret_cast<const T *>(map.data);
+}
+
+// Row-wise writing of .npy files, for arrays that do not fit in memory
+struct npy_file {
+   FILE *fp;
+   size_t rows;
+   size_t row_size;     // bytes per row
+   size_t data_offset;  // bytes before the first row
+};
+
+template <typename T> npy_file npy_create(std::string path, size_t rows, size_t cols);
+void npy_write_rows(npy_file &file, size_t first, size_t count, const void *data);
+size_t npy_close(npy_file &file); // returns the size of the file
+
+bool npy_exists(std::string path);
+
+// The points of madata that have their mask set, in input order. save_masked_ply writes them as a binary
+// PLY file with float coordinates, save_masked_xyz as text with an "x y z" header line and a fixed number of
+// decimals. Batches of points are formatted in parallel and written in order.
+void save_masked_ply(std::string path, const ma_data &madata);
+void save_masked_xyz(std::string path, const ma_data &madata, int decimals);
+
 // Just a convenience function, to call when necessary.
 void convertNPYtoXYZ(std::string input_dir_path);
 
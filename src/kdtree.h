@@ -0,0 +1,235 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_KDTREE_
+#define MASBCPP_KDTREE_
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "nn_search.h"
+#include "types.h"
+
+// Kd-tree specialised for the small-k nearest neighbour queries of the shrinking ball
+// and LFS computations. The points are copied into structure-of-arrays leaf buckets of
+// at most bucket_size points; the nodes are stored in pre-order, so that the left child
+// of a node directly follows it. Queries use a fixed-size stack and do not allocate.
+// Points with non-finite coordinates are not indexed.
+class kdtree : public nn_search {
+public:
+   static const int bucket_size = 16;
+   // median splits keep the depth below log2(n / bucket_size) + 1
+   static const int max_depth = 64;
+
+   kdtree() {}
+   explicit kdtree(const point_array::ConstPtr &cloud) { set_input_cloud(cloud); }
+
+   void set_input_cloud(const point_array::ConstPtr &cloud) {
+      cloud_ = cloud;
+      nodes_.clear();
+
+      // Non-finite points can never be a nearest neighbour, leave them out
+      std::vector<int> perm;
+      perm.reserve(cloud->size());
+      for (size_t i = 0; i < cloud->size(); i++)
+         if (cloud->is_finite(i))
+            perm.push_back(int(i));
+
+      int n = int(perm.size());
+      if (n == 0)
+         return;
+      nodes_.resize(count_nodes(n));
+
+#pragma omp parallel
+#pragma omp single
+      build(perm, 0, 0, n);
+
+      ids_.swap(perm);
+      x_.resize(n); y_.resize(n); z_.resize(n);
+#pragma omp parallel for
+      for (int i = 0; i < n; i++) {
+         x_[i] = cloud->x[ids_[i]]; y_[i] = cloud->y[ids_[i]]; z_[i] = cloud->z[ids_[i]];
+      }
+      min_ = Vector3(*std::min_element(x_.begin(), x_.end()), *std::min_element(y_.begin(), y_.end()), *std::min_element(z_.begin(), z_.end()));
+      max_ = Vector3(*std::max_element(x_.begin(), x_.end()), *std::max_element(y_.begin(), y_.end()), *std::max_element(z_.begin(), z_.end()));
+   }
+
+   const point_array::ConstPtr &input_cloud() const { return cloud_; }
+
+   // Equidistant points are ordered by their index in the cloud, so the results don't depend on the shape of
+   // the tree (and are the same for a subset of the cloud in the same order, as in tiled mode)
+   int nearest(const Vector3 &q, Scalar &sqdist) const {
+      int best = -1;
+      sqdist = std::numeric_limits<Scalar>::max();
+      traverse(q, sqdist, [&](int begin, int end) {
+         for (int i = begin; i < end; i++) {
+            Scalar dx = x_[i] - q[0], dy = y_[i] - q[1], dz = z_[i] - q[2];
+            Scalar d = dx * dx + dy * dy + dz * dz;
+            if (d < sqdist || (d == sqdist && best >= 0 && ids_[i] < ids_[best])) {
+               sqdist = d;
+               best = i;
+            }
+         }
+      });
+      return best < 0 ? -1 : ids_[best];
+   }
+
+   int nearest_k(const Vector3 &q, int k, int *indices, Scalar *sqdists) const {
+      int found = 0;
+      if (k <= 0)
+         return 0;
+
+      Scalar bound = std::numeric_limits<Scalar>::max();
+      traverse(q, bound, [&](int begin, int end) {
+         for (int i = begin; i < end; i++) {
+            Scalar dx = x_[i] - q[0], dy = y_[i] - q[1], dz = z_[i] - q[2];
+            Scalar d = dx * dx + dy * dy + dz * dz;
+            if (d < bound || (d == bound && found == k && ids_[i] < ids_[indices[k - 1]])) {
+               // insertion into the sorted result list
+               int j = found < k ? found++ : k - 1;
+               for (; j > 0 && (sqdists[j - 1] > d || (sqdists[j - 1] == d && ids_[indices[j - 1]] > ids_[i])); j--) {
+                  sqdists[j] = sqdists[j - 1];
+                  indices[j] = indices[j - 1];
+               }
+               sqdists[j] = d;
+               indices[j] = i;
+               if (found == k)
+                  bound = sqdists[k - 1];
+            }
+         }
+      });
+      for (int j = 0; j < found; j++)
+         indices[j] = ids_[indices[j]];
+      return found;
+   }
+
+private:
+   struct kd_node {
+      int dim;        // split dimension, -1 for a leaf
+      Scalar split;   // split value
+      int begin, end; // leaf: range in the bucket arrays, inner node: left and right child
+   };
+
+   struct stack_entry {
+      int node;
+      Scalar sqdist;  // squared distance from the query to the cell of the node
+      Scalar off[3];  // per dimension distance from the query to the cell
+   };
+
+   static int count_nodes(int n) {
+      if (n <= bucket_size)
+         return 1;
+      return 1 + count_nodes(n / 2) + count_nodes(n - n / 2);
+   }
+
+   void build(std::vector<int> &perm, int node, int begin, int end) {
+      kd_node &nd = nodes_[node];
+      int n = end - begin;
+      if (n <= bucket_size) {
+         nd.dim = -1;
+         nd.begin = begin;
+         nd.end = end;
+         return;
+      }
+
+      // split the widest dimension at the median
+      Vector3 min_pt = (*cloud_)[perm[begin]], max_pt = min_pt;
+      for (int i = begin + 1; i < end; i++) {
+         Vector3 p = (*cloud_)[perm[i]];
+         min_pt = min_pt.cwiseMin(p);
+         max_pt = max_pt.cwiseMax(p);
+      }
+      int dim;
+      (max_pt - min_pt).maxCoeff(&dim);
+
+      int mid = begin + n / 2;
+      const std::vector<Scalar> &coord = cloud_->dim(dim);
+      std::nth_element(perm.begin() + begin, perm.begin() + mid, perm.begin() + end,
+         [&coord](int a, int b) { return coord[a] < coord[b]; });
+
+      nd.dim = dim;
+      nd.split = coord[perm[mid]];
+      nd.begin = node + 1;
+      nd.end = node + 1 + count_nodes(n / 2);
+
+      int right = nd.end;
+#pragma omp task shared(perm) if(n > 100000)
+      build(perm, node + 1, begin, mid);
+      build(perm, right, mid, end);
+#pragma omp taskwait
+   }
+
+   // Depth-first traversal that visits the leaves whose cells are closer to q than bound. The
+   // distances to the cells are updated incrementally (Arya and Mount), so that queries far away
+   // from the points, like the centers of large balls, are pruned effectively. scan(begin, end) is
+   // called for every visited leaf and may decrease bound. Cells at distance bound are visited too, for the
+   // points that tie with the current result.
+   template <typename LeafScan>
+   void traverse(const Vector3 &q, const Scalar &bound, LeafScan scan) const {
+      if (nodes_.empty())
+         return;
+
+      stack_entry stack[max_depth];
+      int top = 0;
+      stack_entry cur;
+      cur.node = 0;
+      cur.sqdist = 0;
+      for (int d = 0; d < 3; d++) {
+         cur.off[d] = std::max(Scalar(0), std::max(min_[d] - q[d], q[d] - max_[d]));
+         cur.sqdist += cur.off[d] * cur.off[d];
+      }
+
+      while (true) {
+         if (cur.sqdist <= bound) {
+            int node = cur.node;
+            while (nodes_[node].dim >= 0) {
+               const kd_node &nd = nodes_[node];
+               Scalar diff = q[nd.dim] - nd.split;
+               int near_child = nd.begin, far_child = nd.end;
+               if (diff >= 0)
+                  std::swap(near_child, far_child);
+
+               stack_entry &far = stack[top++];
+               far = cur;
+               far.node = far_child;
+               far.sqdist = cur.sqdist - cur.off[nd.dim] * cur.off[nd.dim] + diff * diff;
+               far.off[nd.dim] = diff;
+               node = near_child;
+            }
+            scan(nodes_[node].begin, nodes_[node].end);
+         }
+         if (top == 0)
+            break;
+         cur = stack[--top];
+      }
+   }
+
+   point_array::ConstPtr cloud_;
+   std::vector<kd_node> nodes_;
+   Vector3 min_, max_; // bounding box of the points
+   std::vector<int> ids_;
+   std::vector<Scalar> x_, y_, z_;
+};
+
+#endif
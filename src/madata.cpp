@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "madata.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+inline uint64_t spread_bits(uint64_t v) {
+   // Insert two zero bits between each of the lower 21 bits of v
+   v &= 0x1fffff;
+   v = (v | v << 32) & 0x1f00000000ffffULL;
+   v = (v | v << 16) & 0x1f0000ff0000ffULL;
+   v = (v | v << 8) & 0x100f00f00f00f00fULL;
+   v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+   v = (v | v << 2) & 0x1249249249249249ULL;
+   return v;
+}
+
+std::vector<int> spatial_order(const point_array &coords) {
+   // Order the points along a Morton (z-order) curve, so that consecutive points are spatial neighbours
+   Vector3 min_pt = Vector3::Constant(std::numeric_limits<Scalar>::max());
+   Vector3 max_pt = Vector3::Constant(-std::numeric_limits<Scalar>::max());
+   for (size_t i = 0; i < coords.size(); i++) {
+      if (!coords.is_finite(i)) continue;
+      Vector3 p = coords[i];
+      min_pt = min_pt.cwiseMin(p);
+      max_pt = max_pt.cwiseMax(p);
+   }
+   Scalar extent = (max_pt - min_pt).maxCoeff();
+   Scalar scale = extent > 0 ? Scalar(0x1fffff) / extent : 0;
+
+   std::vector<std::pair<uint64_t, int> > keys(coords.size());
+#pragma omp parallel for
+   for (int i = 0; i < int(coords.size()); i++) {
+      Vector3 p = coords[i];
+      uint64_t key = 0;
+      if (finite_bits(p)) {
+         Vector3 g = (p - min_pt) * scale;
+         key = spread_bits(uint64_t(g[0])) | spread_bits(uint64_t(g[1])) << 1 | spread_bits(uint64_t(g[2])) << 2;
+      }
+      keys[i] = std::make_pair(key, i);
+   }
+   std::sort(keys.begin(), keys.end());
+
+   std::vector<int> order(coords.size());
+   for (size_t i = 0; i < keys.size(); i++)
+      order[i] = keys[i].second;
+   return order;
+}
+
+std::vector<int> inverse_order(const std::vector<int> &order) {
+   std::vector<int> inverse(order.size());
+#pragma omp parallel for
+   for (long long i = 0; i < (long long)order.size(); i++)
+      inverse[order[i]] = int(i);
+   return inverse;
+}
+
+template <typename T> void gather(std::vector<T> &v, const std::vector<int> &order) {
+   // v[i] = v[order[i]], per block of order.size() elements
+   size_t n = order.size();
+   if (n == 0)
+      return;
+   std::vector<T> sorted(v.size());
+   for (size_t block = 0; block + n <= v.size(); block += n) {
+#pragma omp parallel for
+      for (long long i = 0; i < (long long)n; i++)
+         sorted[block + i] = v[block + order[i]];
+   }
+   v.swap(sorted);
+}
+
+void gather(point_array &points, const std::vector<int> &order) {
+   gather(points.x, order);
+   gather(points.y, order);
+   gather(points.z, order);
+}
+
+void sort_spatially(ma_data &madata) {
+   if (!madata.order.empty())
+      return;
+   madata.order = spatial_order(*madata.coords);
+   const std::vector<int> &order = madata.order;
+
+   gather(*madata.coords, order);
+   if (madata.normals)
+      gather(*madata.normals, order);
+   if (madata.viewpoints)
+      gather(*madata.viewpoints, order);
+   if (madata.ma_coords)
+      gather(*madata.ma_coords, order);
+   gather(madata.ma_radius, order);
+   gather(madata.ma_termination, order);
+   gather(madata.lfs, order);
+   gather(madata.ma_bisec_cos, order);
+
+   // the q indices refer to points, map them to the new positions
+   if (!madata.ma_qidx.empty()) {
+      gather(madata.ma_qidx, order);
+      std::vector<int> inverse = inverse_order(order);
+#pragma omp parallel for
+      for (long long i = 0; i < (long long)madata.ma_qidx.size(); i++)
+         if (madata.ma_qidx[i] != -1)
+            madata.ma_qidx[i] = inverse[madata.ma_qidx[i]];
+   }
+   if (madata.coords_knn && madata.coords_knn->complete())
+      *madata.coords_knn = reorder(*madata.coords_knn, order, inverse_order(order));
+   if (madata.ma_knn && madata.ma_knn->complete())
+      *madata.ma_knn = reorder(*madata.ma_knn, order, inverse_order(order));
+   madata.kd_tree.reset();
+}
+
+inline uint64_t mix_bits(uint64_t v) {
+   // splitmix64 finalizer
+   v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+   return v ^ (v >> 31);
+}
+
+uint64_t ma_fingerprint(const ma_data &madata, size_t n) {
+   // The sum of a hash per MA point (of its input row, position and q index), so that it can be summed in parallel
+   size_t N = madata.coords->size();
+   std::vector<int> inverse = inverse_order(madata.order);
+   uint64_t fingerprint = n;
+#pragma omp parallel for reduction(+:fingerprint)
+   for (long long r = 0; r < (long long)n; r++) {
+      // the inner and the outer MA points are sorted separately
+      size_t block = r / N * N;
+      size_t j = block + (inverse.empty() ? r - block : inverse[r - block]);
+      int q = madata.ma_qidx[j];
+      if (q != -1 && !madata.order.empty())
+         q = madata.order[q];
+      uint32_t bits[3];
+      std::memcpy(&bits[0], &madata.ma_coords->x[j], sizeof(uint32_t));
+      std::memcpy(&bits[1], &madata.ma_coords->y[j], sizeof(uint32_t));
+      std::memcpy(&bits[2], &madata.ma_coords->z[j], sizeof(uint32_t));
+      uint64_t h = mix_bits(uint64_t(r));
+      h = mix_bits(h ^ (uint64_t(bits[0]) << 32 | bits[1]));
+      h = mix_bits(h ^ (uint64_t(bits[2]) << 32 | uint32_t(q)));
+      fingerprint += h;
+   }
+   return fingerprint;
+}
@@ -23,21 +23,60 @@ SOFTWARE.
 #ifndef MASBCPP_MADATA_
 #define MASBCPP_MADATA_
 
+#include <cstdint>
 #include <vector>
 
+#include "neighbour_graph.h"
+#include "nn_search.h"
+#include "point_array.h"
+#include "stats.h"
 #include "types.h"
 
 struct ma_data {
-   PointCloud::Ptr coords;
-   NormalCloud::Ptr normals;
-   PointCloud::Ptr ma_coords;
+   point_array::Ptr coords;
+   point_array::Ptr normals;
+   point_array::Ptr viewpoints; // optional position of the sensor that recorded each point, to orient the normals
+   point_array::Ptr ma_coords;
    std::vector<int> ma_qidx;
    std::vector<float> ma_radius;
+   std::vector<uint8_t> ma_termination; // optional, see compute_masb_points
 
    std::vector<float> lfs;
-   std::vector<bool> mask;
+   std::vector<char> mask; // one byte per point, so that threads can set neighbouring entries
 
-   pcl::search::KdTree<Point>::Ptr kd_tree;
+   nn_search::Ptr kd_tree;
+
+   // Optional neighbour graph caches. A stage that finds an empty graph here fills it with the neighbours it
+   // searches, a stage that finds a complete graph with enough neighbours skips the search.
+   neighbour_graph::Ptr coords_knn; // k + 1 nearest coords of every point, from compute_normals
+   neighbour_graph::Ptr ma_knn;     // bisec_k nearest ma_coords of every MA point, from the bisector cleaning of simplify
+
+   // Optional cache of the bisector cleaning of simplify, for the first ma_bisec_cos.size() / ma_bisec_k MA
+   // points. Column j (element j * rows + i) holds the cosine of the largest angle between the bisector of MA
+   // point i and the bisectors of its j nearest other MA points, or -3 if MA point i has no ball. The cleaning
+   // for any bisector threshold, and any bisec_k up to ma_bisec_k, is a comparison with one column.
+   std::vector<float> ma_bisec_cos;
+   int ma_bisec_k = 0;
+   uint64_t ma_bisec_fingerprint = 0; // ma_fingerprint of the MA points the cache was computed for
+
+   // Set by sort_spatially: point i of the arrays above is point order[i] of the input
+   std::vector<int> order;
+
+   // Optional receiver of the stage timings and counters of the processing functions, see stats.h
+   stats_sink::Ptr stats;
 };
 
+// Order the points along a Morton (z-order) curve, so that consecutive points are spatial neighbours
+std::vector<int> spatial_order(const point_array &coords);
+
+std::vector<int> inverse_order(const std::vector<int> &order);
+
+// Sort the points of madata, and the results computed for them so far, in spatial_order. All later
+// stages then visit the points in a cache friendly order; madata2npy writes the arrays back in input order.
+void sort_spatially(ma_data &madata);
+
+// Fingerprint of the positions and q indices of the first n MA points, in input order (so it doesn't change with
+// sort_spatially), to tell whether a cache computed from them is stale
+uint64_t ma_fingerprint(const ma_data &madata, size_t n);
+
 #endif
@@ -0,0 +1,134 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include <tclap/CmdLine.h>
+
+#include "io.h"
+#include "madata.h"
+#include "pipeline_processing.h"
+#include "stats.h"
+#include "types.h"
+
+int main(int argc, char **argv) {
+   // parse command line arguments
+   try {
+      TCLAP::CmdLine cmd("Estimates normals and computes a MAT point approximation in one pass, see also https://github.com/tudelft3d/masbcpp", ' ', "0.1");
+
+      TCLAP::UnlabeledValueArg<std::string> inputArg("input", "path to directory with inside it a 'coords.npy' file; a Nx3 float array where N is the number of input points.", true, "", "input dir", cmd);
+      TCLAP::UnlabeledValueArg<std::string> outputArg("output", "path to output directory", false, "", "output dir", cmd);
+
+      TCLAP::ValueArg<int> kArg("k", "kneighbours", "number of nearest neighbours to use for PCA", false, 10, "int", cmd);
+      std::vector<std::string> orientations = { "viewpoint", "mst" };
+      TCLAP::ValuesConstraint<std::string> orientationConstraint(orientations);
+      TCLAP::ValueArg<std::string> orientArg("o", "orient", "how to orient the normals: 'viewpoint' makes every normal face the viewpoint, 'mst' propagates a consistent orientation over the surface along a maximum spanning tree of the k-NN graph weighted by the agreement of the normals", false, "viewpoint", &orientationConstraint, cmd);
+      TCLAP::ValueArg<std::string> viewpointArg("", "viewpoint", "viewpoint for the 'viewpoint' orientation", false, "0,0,0", "x,y,z", cmd);
+      TCLAP::SwitchArg sensorSwitch("s", "sensor", "orient every normal towards the position of the sensor that recorded its point, read from the Nx3 float array 'viewpoints.npy' in the input directory", cmd, false);
+      TCLAP::ValueArg<double> denoise_preserveArg("d", "preserve", "denoise preserve threshold", false, 20, "double", cmd);
+      TCLAP::ValueArg<double> denoise_planarArg("p", "planar", "denoise planar threshold", false, 32, "double", cmd);
+      TCLAP::ValueArg<double> initial_radiusArg("r", "radius", "initial ball radius", false, 200, "double", cmd);
+
+      TCLAP::SwitchArg nan_for_initrSwitch("a", "nan", "write nan for points with radius equal to initial radius", cmd, false);
+      TCLAP::SwitchArg packetSwitch("", "packet", "use the packet kernel that advances several balls in lockstep with SIMD instructions", cmd, false);
+      TCLAP::SwitchArg sortSwitch("", "sort", "sort the points along a Morton curve before processing, for better cache locality; the output is written in input order", cmd, false);
+      TCLAP::SwitchArg warm_startSwitch("w", "warm", "warm start: process points in spatially coherent order and start each ball from the radius of a neighbouring ball instead of the initial radius", cmd, false);
+      TCLAP::SwitchArg write_normalsSwitch("n", "normals", "also write the estimated normals to 'normals.npy'", cmd, false);
+      TCLAP::SwitchArg terminationSwitch("t", "termination", "also write 'ma_termination_in.npy' and 'ma_termination_out.npy' with the iterations and the termination of every ball, as compute_ma -t", cmd, false);
+      TCLAP::ValueArg<std::string> statsArg("", "stats-json", "write the stage timings, counters and peak memory use of the run to this JSON file", false, "", "file", cmd);
+
+      cmd.parse(argc, argv);
+
+      normals_parameters normals_params;
+      normals_params.k = kArg.getValue();
+      normals_params.orientation = orientArg.getValue() == "mst" ? normal_orientation::mst : normal_orientation::viewpoint;
+      if (std::sscanf(viewpointArg.getValue().c_str(), "%f,%f,%f", &normals_params.viewpoint[0], &normals_params.viewpoint[1], &normals_params.viewpoint[2]) != 3)
+         throw TCLAP::ArgParseException("expected x,y,z", viewpointArg.getValue());
+
+      ma_parameters ma_params;
+      ma_params.initial_radius = float(initial_radiusArg.getValue());
+      ma_params.denoise_preserve = (M_PI / 180.0) * denoise_preserveArg.getValue();
+      ma_params.denoise_planar = (M_PI / 180.0) * denoise_planarArg.getValue();
+      ma_params.nan_for_initr = nan_for_initrSwitch.getValue();
+      ma_params.warm_start = warm_startSwitch.getValue();
+      ma_params.packet_kernel = packetSwitch.getValue();
+
+      std::string output_path = outputArg.isSet() ? outputArg.getValue() : inputArg.getValue();
+
+      std::cout << "Parameters: k=" << normals_params.k << ", orient=" << orientArg.getValue() << ", denoise_preserve=" << denoise_preserveArg.getValue() << ", denoise_planar=" << denoise_planarArg.getValue() << ", initial_radius=" << ma_params.initial_radius << ", warm_start=" << ma_params.warm_start << ", packet_kernel=" << ma_params.packet_kernel << "\n";
+
+      io_parameters io_params = {};
+      io_params.coords = true;
+      io_params.viewpoints = sensorSwitch.getValue();
+
+      // the stages are printed as they finish
+      ma_data madata = {};
+      std::shared_ptr<stats_recorder> stats(new stats_recorder(&std::cout));
+      madata.stats = stats;
+      npy2madata(inputArg.getValue(), madata, io_params);
+      if (sortSwitch.getValue())
+         sort_spatially(madata);
+
+      std::cout << "Point count: " << madata.coords->size() << std::endl;
+
+      // Perform the actual processing
+      if (terminationSwitch.getValue())
+         madata.ma_termination.resize(2 * madata.coords->size());
+      compute_normals_and_masb_points(normals_params, ma_params, madata);
+
+      io_params.coords = false;
+      io_params.normals = write_normalsSwitch.getValue();
+      io_params.ma_coords = true;
+      io_params.ma_qidx = true;
+      io_params.ma_radius = true;
+      io_params.ma_termination = terminationSwitch.getValue();
+      madata2npy(output_path, madata, io_params);
+
+      {
+         std::string output_path_metadata = output_path + "/compute_ma";
+         std::replace(output_path_metadata.begin(), output_path_metadata.end(), '\\', '/');
+
+         std::ofstream metadata(output_path_metadata.c_str());
+         if (!metadata) {
+            throw TCLAP::ArgParseException("invalid filepath", output_path);
+         }
+
+         metadata
+            << "initial_radius " << ma_params.initial_radius << std::endl
+            << "nan_for_initr " << ma_params.nan_for_initr << std::endl
+            << "denoise_preserve " << denoise_preserveArg.getValue() << std::endl
+            << "denoise_planar " << denoise_planarArg.getValue() << std::endl
+            << "warm_start " << ma_params.warm_start << std::endl
+            << "normals_k " << normals_params.k << std::endl;
+         metadata.close();
+      }
+
+      if (statsArg.isSet())
+         stats->write_json(statsArg.getValue());
+   }
+   catch (TCLAP::ArgException &e) { std::cerr << "Error: " << e.error() << " for " << e.argId() << std::endl; }
+
+   return 0;
+}
@@ -0,0 +1,105 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "neighbour_graph.h"
+
+#include <algorithm>
+
+void neighbour_graph::start(size_t n, int k) {
+   this->k = k;
+   complete_ = false;
+   offsets.resize(n + 1);
+   for (size_t i = 0; i <= n; i++)
+      offsets[i] = int64_t(i) * k;
+   indices.assign(n * k, -1);
+   sqdists.assign(n * k, 0);
+}
+
+void neighbour_graph::set(size_t i, int found, const int *neighbours, const Scalar *distances) {
+   found = std::min(found, k);
+   std::copy(neighbours, neighbours + found, &indices[offsets[i]]);
+   std::copy(distances, distances + found, &sqdists[offsets[i]]);
+}
+
+void neighbour_graph::finish() {
+   // Shift the rows over the unused slots of the rows before them
+   size_t n = size();
+   int64_t next = 0;
+   for (size_t i = 0; i < n; i++) {
+      int64_t begin = offsets[i], end = begin;
+      while (end < begin + k && indices[end] != -1)
+         end++;
+      offsets[i] = next;
+      if (next != begin) {
+         std::copy(indices.begin() + begin, indices.begin() + end, indices.begin() + next);
+         std::copy(sqdists.begin() + begin, sqdists.begin() + end, sqdists.begin() + next);
+      }
+      next += end - begin;
+   }
+   offsets[n] = next;
+   indices.resize(next);
+   sqdists.resize(next);
+   indices.shrink_to_fit();
+   sqdists.shrink_to_fit();
+   complete_ = true;
+}
+
+void neighbour_graph::build(const nn_search &search, const point_array &queries, int k) {
+   start(queries.size(), k);
+#pragma omp parallel
+   {
+      std::vector<int> k_indices(k);
+      std::vector<Scalar> k_distances(k);
+#pragma omp for schedule(dynamic, 256)
+      for (long long i = 0; i < (long long)queries.size(); i++) {
+         int found = search.nearest_k(queries[i], k, k_indices.data(), k_distances.data());
+         set(i, found, k_indices.data(), k_distances.data());
+      }
+   }
+   finish();
+}
+
+neighbour_graph reorder(const neighbour_graph &graph, const std::vector<int> &order, const std::vector<int> &remap) {
+   size_t n = order.size(), rows = graph.size();
+   neighbour_graph result;
+   result.offsets.resize(rows + 1);
+   result.offsets[0] = 0;
+   for (size_t r = 0; r < rows; r++) {
+      size_t block = r - r % n;
+      result.offsets[r + 1] = result.offsets[r] + graph.count(block + order[r % n]);
+   }
+   result.indices.resize(graph.indices.size());
+   result.sqdists.resize(graph.sqdists.size());
+#pragma omp parallel for
+   for (long long r = 0; r < (long long)rows; r++) {
+      size_t block = r - r % n, source = block + order[r % n];
+      const int *neighbours = graph.neighbours(source);
+      int64_t first = result.offsets[r];
+      for (int j = 0; j < graph.count(source); j++) {
+         size_t q = size_t(neighbours[j]);
+         result.indices[first + j] = int(q - q % n + remap[q % n]);
+         result.sqdists[first + j] = graph.distances(source)[j];
+      }
+   }
+   result.assign_complete(graph.k);
+   return result;
+}
@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_NEIGHBOUR_GRAPH_
+#define MASBCPP_NEIGHBOUR_GRAPH_
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "nn_search.h"
+#include "point_array.h"
+#include "types.h"
+
+// The k nearest neighbours of a set of query points, in compressed sparse row layout. The neighbours of
+// query i are indices[offsets[i]] .. indices[offsets[i + 1] - 1], sorted by increasing distance, with their
+// squared distances in sqdists. A query that is a point of the searched cloud is its own first neighbour.
+//
+// The graphs on ma_data are a cache: a stage that needs the neighbours of the same points uses them
+// instead of searching, if the graph holds enough neighbours per point.
+class neighbour_graph {
+public:
+   typedef std::shared_ptr<neighbour_graph> Ptr;
+
+   int k = 0; // number of neighbours that was searched for per query
+   std::vector<int64_t> offsets;
+   std::vector<int> indices;
+   std::vector<Scalar> sqdists;
+
+   size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+   int count(size_t i) const { return int(offsets[i + 1] - offsets[i]); }
+   const int *neighbours(size_t i) const { return indices.data() + offsets[i]; }
+   const Scalar *distances(size_t i) const { return sqdists.data() + offsets[i]; }
+
+   // True if the graph holds (at least) the k nearest neighbours of each of n queries
+   bool covers(size_t n, int k) const { return complete_ && size() == n && this->k >= k; }
+   bool complete() const { return complete_; }
+
+   // Filling a graph in parallel: start() reserves k slots for every query, set() stores the neighbours
+   // of one query, and finish() drops the unused slots.
+   void start(size_t n, int k);
+   void set(size_t i, int found, const int *neighbours, const Scalar *distances);
+   void finish();
+
+   // Search the k nearest neighbours of all queries
+   void build(const nn_search &search, const point_array &queries, int k);
+
+   // Mark a graph whose arrays were filled directly (e.g. read from file) as complete
+   void assign_complete(int k) { this->k = k; complete_ = true; }
+
+private:
+   bool complete_ = false;
+};
+
+// The (at most) k nearest neighbours of query i at position q. They are taken from graph if that is not
+// null, and otherwise searched into the scratch arrays of k elements. Points neighbours at the result
+// and returns their number.
+inline int find_neighbours(const neighbour_graph *graph, const nn_search *search, size_t i, const Vector3 &q, int k,
+                           int *scratch, Scalar *scratch_sqdists, const int *&neighbours) {
+   if (graph) {
+      neighbours = graph->neighbours(i);
+      return std::min(graph->count(i), k);
+   }
+   neighbours = scratch;
+   return search->nearest_k(q, k, scratch, scratch_sqdists);
+}
+
+// Permute the queries and the points of a graph, per block of order.size() rows. Row r of block b of the
+// result is row order[r] of block b, and neighbour index b * n + j becomes b * n + remap[j]. The graphs
+// of sort_spatially take order and its inverse, those written in input order the other way around.
+neighbour_graph reorder(const neighbour_graph &graph, const std::vector<int> &order, const std::vector<int> &remap);
+
+#endif
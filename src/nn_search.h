@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_NN_SEARCH_
+#define MASBCPP_NN_SEARCH_
+
+#include <memory>
+#include <vector>
+
+#include <pcl/search/kdtree.h>
+
+#include "point_array.h"
+#include "types.h"
+
+// Minimal nearest neighbour search interface, so that the processing functions
+// do not depend on one particular spatial index.
+class nn_search {
+public:
+   typedef std::shared_ptr<nn_search> Ptr;
+
+   virtual ~nn_search() {}
+
+   virtual void set_input_cloud(const point_array::ConstPtr &cloud) = 0;
+   virtual const point_array::ConstPtr &input_cloud() const = 0;
+
+   // Find the point closest to q. Returns its index, or -1 if the index is empty.
+   virtual int nearest(const Vector3 &q, Scalar &sqdist) const = 0;
+
+   // Find the k points closest to q, sorted by increasing distance. The output arrays
+   // must hold at least k elements. Returns the number of points found.
+   virtual int nearest_k(const Vector3 &q, int k, int *indices, Scalar *sqdists) const = 0;
+};
+
+// Adapter for the PCL (FLANN) kd-tree, which indexes a pcl::PointCloud copy of the points
+class pcl_search : public nn_search {
+public:
+   pcl_search() : tree_(new pcl::search::KdTree<Point>()) {}
+   explicit pcl_search(const point_array::ConstPtr &cloud) : tree_(new pcl::search::KdTree<Point>()) {
+      set_input_cloud(cloud);
+   }
+
+   void set_input_cloud(const point_array::ConstPtr &cloud) {
+      cloud_ = cloud;
+      pcl_cloud_ = to_pcl_cloud(*cloud);
+      tree_->setInputCloud(pcl_cloud_);
+   }
+
+   const point_array::ConstPtr &input_cloud() const { return cloud_; }
+
+   int nearest(const Vector3 &q, Scalar &sqdist) const {
+      int index;
+      if (nearest_k(q, 1, &index, &sqdist) == 0)
+         return -1;
+      return index;
+   }
+
+   int nearest_k(const Vector3 &q, int k, int *indices, Scalar *sqdists) const {
+      static thread_local std::vector<int> k_indices;
+      static thread_local std::vector<Scalar> k_distances;
+
+      Point p;
+      p.getVector3fMap() = q;
+      int found = tree_->nearestKSearch(p, k, k_indices, k_distances);
+      std::copy(k_indices.begin(), k_indices.begin() + found, indices);
+      std::copy(k_distances.begin(), k_distances.begin() + found, sqdists);
+      return found;
+   }
+
+   const pcl::search::KdTree<Point>::Ptr &tree() const { return tree_; }
+   const PointCloud::Ptr &pcl_cloud() const { return pcl_cloud_; }
+
+private:
+   point_array::ConstPtr cloud_;
+   PointCloud::Ptr pcl_cloud_;
+   pcl::search::KdTree<Point>::Ptr tree_;
+};
+
+#endif
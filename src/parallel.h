@@ -0,0 +1,234 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_PARALLEL_
+#define MASBCPP_PARALLEL_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+#ifdef WITH_OPENMP
+#include <omp.h>
+#endif
+
+// Build the packet kernels for several instruction sets, the best one is selected at runtime
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define MASB_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define MASB_TARGET_CLONES
+#endif
+
+// Number of consecutive points that a thread takes from the shared work queue at a time. The chunks
+// are small enough to balance the load, and large enough that a thread visits a spatially coherent
+// run of points when they are in Morton order.
+const int dynamic_chunk_size = 256;
+
+inline int thread_count() {
+#ifdef WITH_OPENMP
+   return omp_get_max_threads();
+#else
+   return 1;
+#endif
+}
+
+inline int thread_id() {
+#ifdef WITH_OPENMP
+   return omp_get_thread_num();
+#else
+   return 0;
+#endif
+}
+
+// Exclusive prefix sum over [0, n) in parallel: emit(i, prefix) is called for every i, with prefix the sum of
+// count(0) .. count(i - 1). The range is split in one contiguous block per thread, which is visited twice:
+// once to sum it, and once to emit it starting from the sum of the blocks before it. count(i) is read before
+// emit(i, prefix) is called, so emit may overwrite what count reads. Returns the sum of all counts.
+template <typename Count, typename Emit>
+int64_t parallel_scan(size_t n, Count count, Emit emit) {
+   int blocks = thread_count();
+   std::vector<int64_t> block_sums(blocks + 1, 0);
+#pragma omp parallel
+   {
+#pragma omp for schedule(static, 1)
+      for (int b = 0; b < blocks; b++) {
+         int64_t sum = 0;
+         for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++)
+            sum += count(i);
+         block_sums[b + 1] = sum;
+      }
+#pragma omp single
+      for (int b = 0; b < blocks; b++)
+         block_sums[b + 1] += block_sums[b];
+#pragma omp for schedule(static, 1)
+      for (int b = 0; b < blocks; b++) {
+         int64_t prefix = block_sums[b];
+         for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++) {
+            int64_t c = count(i);
+            emit(i, prefix);
+            prefix += c;
+         }
+      }
+   }
+   return block_sums[blocks];
+}
+
+// Stable sort of the (key, value) pairs by the lowest key_bits bits of their keys, with a parallel least
+// significant digit radix sort. In every pass of 8 bits each thread counts the digits of a contiguous
+// block of the pairs, the counts give every block its own range of positions per digit, and each
+// thread moves its block to those positions.
+template <typename Value>
+void parallel_radix_sort(std::vector<uint64_t> &keys, std::vector<Value> &values, int key_bits) {
+   const int digit_bits = 8, digits = 1 << digit_bits;
+   size_t n = keys.size();
+   int blocks = thread_count();
+   std::vector<uint64_t> sorted_keys(n);
+   std::vector<Value> sorted_values(n);
+   std::vector<size_t> positions(size_t(blocks) * digits);
+   for (int shift = 0; shift < key_bits; shift += digit_bits) {
+#pragma omp parallel
+      {
+#pragma omp for schedule(static, 1)
+         for (int b = 0; b < blocks; b++) {
+            size_t *count = &positions[size_t(b) * digits];
+            std::fill(count, count + digits, size_t(0));
+            for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++)
+               count[(keys[i] >> shift) & (digits - 1)]++;
+         }
+#pragma omp single
+         {
+            // the pairs with digit d of block b follow those with digit d of the blocks before b
+            size_t position = 0;
+            for (int d = 0; d < digits; d++)
+               for (int b = 0; b < blocks; b++) {
+                  size_t count = positions[size_t(b) * digits + d];
+                  positions[size_t(b) * digits + d] = position;
+                  position += count;
+               }
+         }
+#pragma omp for schedule(static, 1)
+         for (int b = 0; b < blocks; b++) {
+            size_t *position = &positions[size_t(b) * digits];
+            for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++) {
+               size_t p = position[(keys[i] >> shift) & (digits - 1)]++;
+               sorted_keys[p] = keys[i];
+               sorted_values[p] = values[i];
+            }
+         }
+      }
+      keys.swap(sorted_keys);
+      values.swap(sorted_values);
+   }
+}
+
+// Lock-free progress counter for parallel loops. The threads add their work as it is done; the
+// callback is called by whichever thread passes the next reporting step, never by two threads at once.
+class progress_counter {
+public:
+   progress_counter(std::function<void(size_t)> callback, size_t step = 5000)
+      : callback_(callback), step_(step), count_(0), next_report_(step) {
+      busy_.clear();
+   }
+
+   void add(size_t n) {
+      size_t count = count_.fetch_add(n, std::memory_order_relaxed) + n;
+      if (!callback_ || count < next_report_.load(std::memory_order_relaxed))
+         return;
+      // another thread is reporting, skip this one
+      if (busy_.test_and_set(std::memory_order_acquire))
+         return;
+      // report the current count, so that the reported values never decrease
+      count = count_.load(std::memory_order_relaxed);
+      if (count >= next_report_.load(std::memory_order_relaxed)) {
+         next_report_.store(count + step_, std::memory_order_relaxed);
+         callback_(count);
+      }
+      busy_.clear(std::memory_order_release);
+   }
+
+   size_t count() const { return count_.load(); }
+
+private:
+   std::function<void(size_t)> callback_;
+   size_t step_;
+   std::atomic<size_t> count_;
+   std::atomic<size_t> next_report_;
+   std::atomic_flag busy_;
+};
+
+// Busy and idle time of every thread of a parallel loop. Each thread calls start() when it starts
+// working and finish() when it runs out of work. The idle time of a thread is the time between the
+// first thread starting and the last thread finishing in which it did not work.
+class load_balance {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   load_balance() : start_(thread_count()), finish_(thread_count()) {}
+
+   void start() { start_[thread_id()] = Clock::now(); }
+   void finish() { finish_[thread_id()] = Clock::now(); }
+
+   // Reports the efficiency (busy time of the threads over their number times the span of the loop) as
+   // value name/efficiency, in percent, the longest time a thread waited for the others as
+   // name/longest_idle_ms, and the busy and idle time of every thread t as name/thread/<t>/busy_ms and
+   // name/thread/<t>/idle_ms
+   void report(stats_sink *sink, const std::string &name) const {
+      if (!sink)
+         return;
+      // threads that were not started (fewer threads in the team than the maximum) are left out
+      size_t threads = 0;
+      Clock::time_point begin = Clock::time_point::max(), end = Clock::time_point::min();
+      for (size_t t = 0; t < start_.size(); t++) {
+         if (start_[t] == Clock::time_point()) continue;
+         threads++;
+         begin = std::min(begin, start_[t]);
+         end = std::max(end, finish_[t]);
+      }
+      if (threads == 0)
+         return;
+
+      double span = std::chrono::duration<double, std::milli>(end - begin).count();
+      double busy_sum = 0, idle_max = 0;
+      for (size_t t = 0; t < start_.size(); t++) {
+         if (start_[t] == Clock::time_point()) continue;
+         double busy = std::chrono::duration<double, std::milli>(finish_[t] - start_[t]).count();
+         busy_sum += busy;
+         idle_max = std::max(idle_max, span - busy);
+         std::string thread_name = name + "/thread/" + std::to_string(t);
+         sink->value(thread_name + "/busy_ms", busy);
+         sink->value(thread_name + "/idle_ms", span - busy);
+      }
+      sink->value(name + "/efficiency", span > 0 ? 100 * busy_sum / (span * threads) : 100);
+      sink->value(name + "/longest_idle_ms", idle_max);
+   }
+
+private:
+   std::vector<Clock::time_point> start_, finish_;
+};
+
+#endif
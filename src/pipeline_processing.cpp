@@ -0,0 +1,68 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "pipeline_processing.h"
+#include "kdtree.h"
+
+#include <vector>
+
+//==============================
+//   NORMALS + MA
+//==============================
+
+void compute_normals_and_masb_points(normals_parameters &normals_params, ma_parameters &ma_params, ma_data &madata, progress_callback callback) {
+   stage_timer timer(madata.stats.get(), "normals/kd_tree");
+   if (!madata.kd_tree)
+      madata.kd_tree.reset(new kdtree(madata.coords));
+   timer.stop();
+
+   size_t n = madata.coords->size();
+   madata.normals.reset(new point_array);
+   madata.normals->resize(n);
+   madata.ma_coords.reset(new point_array);
+   madata.ma_coords->resize(2 * n);
+   madata.ma_qidx.resize(2 * n);
+   madata.ma_radius.resize(2 * n);
+
+   // Orienting along a spanning tree needs all normals first, so that can't be fused
+   if (normals_params.orientation == normal_orientation::mst) {
+      compute_normals(normals_params, madata);
+      compute_masb_points(ma_params, madata, callback);
+      return;
+   }
+
+   neighbour_graph *graph = madata.coords_knn.get();
+   bool fill_graph = graph && !graph->covers(n, normals_params.k + 1);
+   if (fill_graph)
+      graph->start(n, normals_params.k + 1);
+   if (madata.stats)
+      madata.stats->count("normals/kd_tree_queries", graph && !fill_graph ? 0 : n);
+
+   // Every chunk is prepared by exactly one thread, so the threads write disjoint normals
+   auto prepare = [&normals_params, &madata](const std::vector<int> &points) {
+      estimate_normals(normals_params, madata, points);
+   };
+
+   compute_masb_points(ma_params, madata, callback, prepare);
+   if (fill_graph)
+      graph->finish();
+}
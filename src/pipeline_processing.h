@@ -0,0 +1,36 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_PIPELINE_PROCESSING_
+#define MASBCPP_PIPELINE_PROCESSING_
+
+#include "compute_ma_processing.h"
+#include "compute_normals_processing.h"
+
+// compute_normals followed by compute_masb_points in a single pass over the points. One kd-tree is built
+// (or the one on madata is reused) for both stages, and the normals of each chunk of points are estimated
+// by the thread that shrinks the balls of that chunk right after, while their neighbourhood is in cache.
+// The normals, ma_coords, ma_qidx and ma_radius arrays of madata are allocated here. With the mst
+// orientation the normals are all estimated and oriented before the balls are shrunk.
+void compute_normals_and_masb_points(normals_parameters &normals_params, ma_parameters &ma_params, ma_data &madata, progress_callback callback = {});
+
+#endif
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_POINT_ARRAY_
+#define MASBCPP_POINT_ARRAY_
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "types.h"
+
+// 3D points (or normals) in structure-of-arrays layout. Compared to pcl::PointCloud this takes
+// 12 bytes per point instead of 16 for pcl::PointXYZ and 32 for pcl::Normal, and the kernels can
+// stream through the contiguous x, y and z arrays.
+class point_array {
+public:
+   typedef std::shared_ptr<point_array> Ptr;
+   typedef std::shared_ptr<const point_array> ConstPtr;
+
+   std::vector<Scalar> x, y, z;
+
+   point_array() {}
+   explicit point_array(size_t n) : x(n), y(n), z(n) {}
+
+   size_t size() const { return x.size(); }
+   bool empty() const { return x.empty(); }
+
+   void resize(size_t n) { x.resize(n); y.resize(n); z.resize(n); }
+   void reserve(size_t n) { x.reserve(n); y.reserve(n); z.reserve(n); }
+   void clear() { x.clear(); y.clear(); z.clear(); }
+
+   void push_back(Scalar px, Scalar py, Scalar pz) { x.push_back(px); y.push_back(py); z.push_back(pz); }
+   void push_back(const Vector3 &p) { push_back(p[0], p[1], p[2]); }
+
+   Vector3 operator[](size_t i) const { return Vector3(x[i], y[i], z[i]); }
+   void set(size_t i, Scalar px, Scalar py, Scalar pz) { x[i] = px; y[i] = py; z[i] = pz; }
+   void set(size_t i, const Vector3 &p) { set(i, p[0], p[1], p[2]); }
+
+   // coordinate array of dimension d (0, 1 or 2)
+   std::vector<Scalar> &dim(int d) { return d == 0 ? x : d == 1 ? y : z; }
+   const std::vector<Scalar> &dim(int d) const { return d == 0 ? x : d == 1 ? y : z; }
+
+   bool is_finite(size_t i) const { return finite_bits(x[i]) && finite_bits(y[i]) && finite_bits(z[i]); }
+};
+
+// Adapters for the parts of the pipeline that still use PCL
+inline PointCloud::Ptr to_pcl_cloud(const point_array &points) {
+   PointCloud::Ptr cloud(new PointCloud);
+   cloud->resize(points.size());
+#pragma omp parallel for
+   for (long long i = 0; i < (long long)points.size(); i++)
+      (*cloud)[i] = Point(points.x[i], points.y[i], points.z[i]);
+   return cloud;
+}
+
+inline void from_pcl_normals(const NormalCloud &normals, point_array &points) {
+   points.resize(normals.size());
+#pragma omp parallel for
+   for (long long i = 0; i < (long long)normals.size(); i++)
+      points.set(i, normals[i].normal_x, normals[i].normal_y, normals[i].normal_z);
+}
+
+#endif
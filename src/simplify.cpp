@@ -20,9 +20,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
 
 // tclap
 #include <tclap/CmdLine.h>
@@ -30,8 +33,82 @@ SOFTWARE.
 // typedefs
 #include "simplify_processing.h"
 #include "io.h"
+#include "stats.h"
 
+// Read the settings of a sweep, one per line as "epsilon cellsize [upper [lower]]". The density bounds
+// default to those of -u and -l, empty lines and lines starting with '#' are skipped.
+std::vector<sweep_parameters> read_sweep(std::string path, double maximum_density, double minimum_density)
+{
+    std::ifstream ifs(path.c_str());
+    if (!ifs)
+        throw TCLAP::ArgParseException("cannot open sweep file", path);
+
+    std::vector<sweep_parameters> sweep;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream iss(line);
+        sweep_parameters s;
+        if (!(iss >> s.epsilon)) {
+            iss.clear();
+            std::string first;
+            if (!(iss >> first) || first[0] == '#')
+                continue;
+            throw TCLAP::ArgParseException("expected epsilon cellsize [upper [lower]]", line);
+        }
+        if (!(iss >> s.cellsize) || s.cellsize <= 0)
+            throw TCLAP::ArgParseException("expected epsilon cellsize [upper [lower]]", line);
+        if (!(iss >> s.maximum_density))
+            s.maximum_density = maximum_density;
+        if (!(iss >> s.minimum_density))
+            s.minimum_density = minimum_density;
+        sweep.push_back(s);
+    }
+    if (sweep.empty())
+        throw TCLAP::ArgParseException("no settings in sweep file", path);
+    return sweep;
+}
+
+// Write the masks of a sweep as one Nx(T+7)/8 uint8 array (just N long if T <= 8), with the mask of setting t
+// in bit 7 - t % 8 of column t / 8 so that np.unpackbits(a.reshape(N, -1), axis=1)[:, :T] unpacks it, and
+// the settings with their counts as text
+void write_sweep(std::string output_path, const ma_data &madata, const std::vector<sweep_parameters> &sweep,
+                 const std::vector<std::vector<bool> > &masks, const std::vector<size_t> &counts)
+{
+    size_t N = madata.coords->size(), T = sweep.size(), cols = (T + 7) / 8;
+    std::vector<int> inverse;
+    if (!madata.order.empty())
+        inverse = inverse_order(madata.order);
 
+    std::cout << "Writing sweep mask array..." << std::endl;
+    npy_file file = npy_create<uint8_t>(output_path + "/sweep_mask.npy", N, cols);
+    const size_t chunk_rows = 1 << 16;
+    std::vector<uint8_t> buffer(chunk_rows * cols);
+    for (size_t first = 0; first < N; first += chunk_rows) {
+        size_t count = std::min(chunk_rows, N - first);
+        std::fill(buffer.begin(), buffer.end(), 0);
+        for (size_t r = 0; r < count; r++) {
+            size_t i = inverse.empty() ? first + r : inverse[first + r];
+            for (size_t t = 0; t < T; t++)
+                if (masks[t].size() == N && masks[t][i])
+                    buffer[r * cols + t / 8] |= uint8_t(0x80 >> (t % 8));
+        }
+        npy_write_rows(file, first, count, buffer.data());
+    }
+    size_t bytes = npy_close(file);
+    if (madata.stats)
+        madata.stats->count("io/bytes_written", bytes);
+
+    std::string outFile = output_path + "/sweep.txt";
+    std::ofstream ofs(outFile.c_str());
+    if (!ofs) {
+        std::cerr << "Invalid file path " << outFile << std::endl;
+        exit(1);
+    }
+    ofs << "epsilon cellsize upper lower count" << std::endl;
+    for (size_t t = 0; t < T; t++)
+        ofs << sweep[t].epsilon << " " << sweep[t].cellsize << " " << sweep[t].maximum_density << " "
+            << sweep[t].minimum_density << " " << counts[t] << std::endl;
+}
 
 int main(int argc, char **argv)
 {
@@ -53,10 +130,20 @@ int main(int argc, char **argv)
         TCLAP::SwitchArg innerSwitch("i","inner","Compute LFS using only interior MAT points.", cmd, false);
         TCLAP::SwitchArg squaredSwitch("s","squared","Use squared LFS during simplification.", cmd, false);
         TCLAP::SwitchArg nolfsSwitch("d","no-lfs","Don't recompute lfs.'", cmd, false);
+        TCLAP::SwitchArg graphSwitch("g","graph","Cache the neighbours of the MAT points that are used for the bisector cleaning in 'ma_knn_*.npy' files. If the input directory has them they are read, so that re-running with other parameters skips the neighbour search (unless -k is larger or -i differs); otherwise they are written to the output directory.", cmd, false);
+        TCLAP::SwitchArg bisecCacheSwitch("","bisec-cache","Cache the bisector angles of the MAT points, for every number of neighbours up to -k, in 'ma_bisec_cos.npy'. If the input directory has it, it is read, so that re-running with another -b or a smaller -k only compares it with the threshold (unless -k is larger or -i differs); otherwise it is written to the output directory.", cmd, false);
+        TCLAP::SwitchArg sortSwitch("","sort","Sort the points along a Morton curve before processing, for better cache locality. The output is written in input order.", cmd, false);
         
         TCLAP::ValueArg<std::string> outputXYZArg("a","xyz","output filtered points to plain .xyz text file",false,"lfs_simp.xyz","string", cmd);
+        TCLAP::ValueArg<int> decimalsArg("","decimals","Number of decimals of the coordinates in the .xyz file, from 0 to 9.",false,3,"int", cmd);
+        TCLAP::ValueArg<std::string> outputPLYArg("","ply","output filtered points to a binary .ply file",false,"lfs_simp.ply","string", cmd);
+        TCLAP::ValueArg<std::string> statsArg("","stats-json","Write the stage timings, counters and peak memory use of the run to this JSON file.",false,"","file", cmd);
+        TCLAP::ValueArg<std::string> sweepArg("","sweep","Compute the LFS once and simplify with every setting in this text file, one per line as 'epsilon cellsize [upper [lower]]' (-e, -c, -u and -l are ignored). The masks are written to 'sweep_mask.npy' (packed bits, one column of bits per setting) and the number of remaining points of each setting to 'sweep.txt'.",false,"","file", cmd);
 
         cmd.parse(argc,argv);
+        // the fixed point formatting of the .xyz file works on 64-bit integers
+        if( decimalsArg.getValue() < 0 || decimalsArg.getValue() > 9 )
+            throw TCLAP::ArgParseException("expected 0 to 9 decimals", std::to_string(decimalsArg.getValue()));
         
         simplify_parameters input_parameters;
 
@@ -75,13 +162,20 @@ int main(int argc, char **argv)
         if( fake3dArg.isSet() )
            input_parameters.true_z_dim = false;
 
+        std::vector<sweep_parameters> sweep;
+        if( sweepArg.isSet() )
+            sweep = read_sweep(sweepArg.getValue(), input_parameters.maximum_density, input_parameters.minimum_density);
+
         std::string output_path = inputArg.getValue();
         if(outputArg.isSet())
             output_path = outputArg.getValue();
         std::replace(output_path.begin(), output_path.end(), '\\', '/');
 
 
+        // the stages are printed as they finish
         ma_data madata = {};
+        std::shared_ptr<stats_recorder> stats(new stats_recorder(&std::cout));
+        madata.stats = stats;
         io_parameters input_params = {};
         input_params.coords = true;
         input_params.ma_coords = true;
@@ -89,8 +183,20 @@ int main(int argc, char **argv)
         if(!input_parameters.compute_lfs){
            input_params.lfs = true;
         }
+        bool graph_cached = graphSwitch.getValue() && npy_exists(inputArg.getValue() + "/ma_knn_offsets.npy");
+        input_params.ma_knn = graph_cached;
+        bool bisec_cached = bisecCacheSwitch.getValue() && npy_exists(inputArg.getValue() + "/ma_bisec_cos.npy");
+        input_params.ma_bisec_cos = bisec_cached;
 
         npy2madata(inputArg.getValue(), madata, input_params);
+        if(graphSwitch.getValue() && !madata.ma_knn)
+           madata.ma_knn.reset(new neighbour_graph);
+        // a cached graph of the other MAT points, or with too few neighbours, is searched again and written again
+        size_t ma_count = (input_parameters.only_inner ? 1 : 2) * madata.coords->size();
+        bool graph_reused = graph_cached && madata.ma_knn->covers(ma_count, input_parameters.bisec_k);
+        bool bisec_reused = bisec_cached && bisec_cos_covers(madata, ma_count, input_parameters.bisec_k);
+        if(sortSwitch.getValue())
+           sort_spatially(madata);
 
         if(input_parameters.compute_lfs)
         {
@@ -98,13 +204,36 @@ int main(int argc, char **argv)
         }
         madata.mask.resize(madata.coords->size());
 
+        if( !sweep.empty() )
+        {
+            std::vector<std::vector<bool> > masks;
+            std::vector<size_t> counts;
+            if( !simplify_sweep(input_parameters, sweep, madata, masks, counts) ) {
+                std::cerr << "No MAT points are left after bisector cleaning, can't compute the lfs" << std::endl;
+                exit(1);
+            }
+
+            for( size_t t=0; t<sweep.size(); t++ )
+                std::cout << "epsilon " << sweep[t].epsilon << ", cellsize " << sweep[t].cellsize << ": " << counts[t] << " out of " << madata.coords->size() << " points remaining [" << int(100*float(counts[t])/madata.coords->size()) << "%]" << std::endl;
+
+            io_parameters output_params = {};
+            output_params.lfs = input_parameters.compute_lfs;
+            output_params.ma_knn = graphSwitch.getValue() && !graph_reused;
+            output_params.ma_bisec_cos = bisecCacheSwitch.getValue() && !bisec_reused;
+            madata2npy(output_path, madata, output_params);
+            write_sweep(output_path, madata, sweep, masks, counts);
+            if( statsArg.isSet() )
+                stats->write_json(statsArg.getValue());
+            return 0;
+        }
+
 	    {
           // Perform the actual processing
           simplify_lfs(input_parameters, madata);
           
           // count number of remaining points
           unsigned int cnt(0);
-          for( int i=0; i<madata.coords->size(); i++ )
+          for( size_t i=0; i<madata.coords->size(); i++ )
                 if( madata.mask[i] ) cnt++;
           std::cout << cnt << " out of " << madata.coords->size() << " points remaining [" << int(100*float(cnt)/madata.coords->size()) << "%]" << std::endl;
 
@@ -112,42 +241,23 @@ int main(int argc, char **argv)
           io_parameters output_params = {};
           output_params.lfs = true;
           output_params.mask = true;
+          output_params.ma_knn = graphSwitch.getValue() && !graph_reused;
+          output_params.ma_bisec_cos = bisecCacheSwitch.getValue() && !bisec_reused;
           madata2npy(output_path, madata, output_params);
         }
 
-        if( true || outputXYZArg.isSet() ){
-            /*
-            std::string outFile_bounds = outputXYZArg.getValue();
-            outFile_bounds.append(".bounds");
-            std::replace(outFile_bounds.begin(), outFile_bounds.end(), '\\', '/');
-            
-            std::ofstream ofs_bounds(outFile_bounds.c_str());
-            ofs_bounds << madata.bbox.min[0] << std::endl << madata.bbox.max[0] << 
-             std::endl << madata.bbox.min[1] << std::endl << madata.bbox.max[1] << 
-             std::endl << madata.bbox.min[2] << std::endl << madata.bbox.max[2] << std::endl;
-            
-            ofs_bounds.close();
-            */
-
-            std::string outFile_xyz = outputXYZArg.getValue();
-            std::replace(outFile_xyz.begin(), outFile_xyz.end(), '\\', '/');
-            std::ofstream ofs(outFile_xyz.c_str());
-            //ofs <<std::setprecision(2)<<std::fixed;
-            
-            // many pointcloud xyz readers prefer a "header" line.
-            ofs << "x y z" << std::endl;
-
-            for( int i=0; i<madata.coords->size(); i++ ) {
-                if( madata.mask[i] ){
-                    ofs << (*madata.coords)[i].x;
-                    ofs << " " << (*madata.coords)[i].y;
-                    ofs << " " << (*madata.coords)[i].z;
-                ofs << std::endl;
-                }
-            }
-            
-            ofs.close();
+        if( outputPLYArg.isSet() ){
+            std::cout << "Writing filtered points to " << outputPLYArg.getValue() << "..." << std::endl;
+            save_masked_ply(outputPLYArg.getValue(), madata);
         }
+
+        if( outputXYZArg.isSet() ){
+            std::cout << "Writing filtered points to " << outputXYZArg.getValue() << "..." << std::endl;
+            save_masked_xyz(outputXYZArg.getValue(), madata, decimalsArg.getValue());
+        }
+
+        if( statsArg.isSet() )
+            stats->write_json(statsArg.getValue());
 	} catch (TCLAP::ArgException &e) { std::cerr << "Error: " << e.error() << " for " << e.argId() << std::endl; }
 
     return 0;
@@ -20,25 +20,19 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include <algorithm>
+#include <cstdint>
 #include <limits>
+#include <memory>
 #include <random>
 
-#include <pcl/common/common.h>
-
-#ifdef VERBOSEPRINT
-#include <chrono>
 #include <iostream>
-#endif
 
 // OpenMP
 #ifdef WITH_OPENMP
 #include <omp.h>
 #endif
 
-#ifdef VERBOSEPRINT
-typedef std::chrono::high_resolution_clock Clock;
-#endif
-
 /*
 // Vrui
 #include <vrui/Geometry/ComponentArray.h>
@@ -54,6 +48,8 @@ typedef std::chrono::high_resolution_clock Clock;
 
 // typedefs
 #include "simplify_processing.h"
+#include "kdtree.h"
+#include "parallel.h"
 
 
 
@@ -65,279 +61,390 @@ typedef std::chrono::high_resolution_clock Clock;
 
 
 
-bool compute_lfs(ma_data &madata, double bisec_threshold, int bisec_k, bool only_inner = true)
+bool bisec_cos_covers(const ma_data &madata, size_t n, int bisec_k)
 {
-#ifdef VERBOSEPRINT
-   auto start_time = Clock::now();
-#endif
+   return madata.ma_bisec_k >= std::max(bisec_k, 1) && madata.ma_bisec_cos.size() == n * madata.ma_bisec_k;
+}
 
-   size_t N = 2 * madata.coords->size();
-   if (only_inner) {
-      N = madata.coords->size();
-      (*madata.ma_coords).resize(N); // HACK this will destroy permanently the exterior ma_coords!
-   }
-   // compute bisector and filter .. rebuild kdtree .. compute lfs .. compute grid .. thin each cell
+void compute_bisec_cos(ma_data &madata, size_t N, int bisec_k)
+{
+   stage_timer timer(madata.stats.get(), "lfs/bisectors");
+   // column 0 is MA point i by itself
+   int cols = std::max(bisec_k, 1);
 
-   int count = 0;
+   // The bisectors of the MA points that have a ball. An MA point without a ball (a ball that stopped at its
+   // first step) can still be a neighbour, its bisector is zero, so it makes an angle of 90 degrees with any other.
    Vector3List ma_bisec(N);
-   //madata.ma_bisec = &ma_bisec;
-   for (int i = 0; i < N; i++) {
+#pragma omp parallel for schedule(static)
+   for (long long i = 0; i < (long long)N; i++) {
       if (madata.ma_qidx[i] != -1) {
-         Vector3 f1 = (*madata.coords)[i%madata.coords->size()].getVector3fMap() - (*madata.ma_coords)[i].getVector3fMap();
-         Vector3 f2 = (*madata.coords)[madata.ma_qidx[i]].getVector3fMap() - (*madata.ma_coords)[i].getVector3fMap();
+         Vector3 f1 = (*madata.coords)[i%madata.coords->size()] - (*madata.ma_coords)[i];
+         Vector3 f2 = (*madata.coords)[madata.ma_qidx[i]] - (*madata.ma_coords)[i];
 
          ma_bisec[i] = (f1 + f2).normalized();
-         count++;
+      } else {
+         ma_bisec[i] = Vector3::Zero();
       }
    }
-#ifdef VERBOSEPRINT
-   auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-   std::cout << "Computed bisectors in " << elapsed_time.count() << " ms" << std::endl;
-   start_time = Clock::now();
-#endif
-
-   // We can't produce LFS values if there are no MAT points
-   if (count == 0)
-      return false;
 
-   count = 0;
-   std::vector<bool> bisec_mask(N);
+   // The neighbours of the MA points only depend on ma_coords, take them from the cached graph if possible
+   neighbour_graph *graph = madata.ma_knn.get();
+   const neighbour_graph *cached = graph && graph->covers(N, cols) ? graph : nullptr;
+   neighbour_graph *filling = graph && !cached ? graph : nullptr;
+   if (filling)
+      filling->start(N, cols);
+
+   timer.next("lfs/kd_tree");
+   std::unique_ptr<kdtree> kd_tree;
+   if (!cached)
+      kd_tree.reset(new kdtree(madata.ma_coords));
+   timer.next("lfs/bisector_angles");
+
+   madata.ma_bisec_k = cols;
+   madata.ma_bisec_fingerprint = ma_fingerprint(madata, N);
+   madata.ma_bisec_cos.resize(N * cols);
+   float *bisec_cos = &madata.ma_bisec_cos[0];
+   load_balance balance;
+#pragma omp parallel
    {
-      pcl::search::KdTree<Point>::Ptr kd_tree(new pcl::search::KdTree<Point>());
-      kd_tree->setInputCloud(madata.ma_coords);
-#ifdef VERBOSEPRINT
-      auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-      std::cout << "Constructed kd-tree in " << elapsed_time.count() << " ms" << std::endl;
-      start_time = Clock::now();
-#endif
-
+      balance.start();
       // Results from our search
-      std::vector<int> k_indices(bisec_k);
-      std::vector<Scalar> k_distances(bisec_k);
-
-#pragma omp parallel for private(k_indices, k_distances)
-      for (int i = 0; i < N; i++) {
-         bisec_mask[i] = false;
-         if (madata.ma_qidx[i] != -1) {
-            kd_tree->nearestKSearch((*madata.ma_coords)[i], bisec_k, k_indices, k_distances); // find closest point to c
-
-            float bisec_angle, max_bisec_angle = 0;
-            for (int j = 1; j < k_indices.size(); j++){
-                  bisec_angle = std::acos(ma_bisec[k_indices[j]].dot(ma_bisec[i]));
-                  if (bisec_angle > max_bisec_angle)
-                        max_bisec_angle = bisec_angle;
-            }
-            if (max_bisec_angle < bisec_threshold)
-            {
-               bisec_mask[i] = true;
-               count++;
-            }
+      std::vector<int> k_indices(cols);
+      std::vector<Scalar> k_distances(cols);
+#pragma omp for schedule(dynamic, dynamic_chunk_size) nowait
+      for (long long i = 0; i < (long long)N; i++) {
+         if (madata.ma_qidx[i] == -1) {
+            for (int j = 0; j < cols; j++)
+               bisec_cos[j * N + i] = -3; // below the cosine of any angle, so it never passes
+            continue;
+         }
+         const int *neighbours;
+         int found = find_neighbours(cached, kd_tree.get(), i, (*madata.ma_coords)[i], cols, &k_indices[0], &k_distances[0], neighbours); // find closest point to c
+         if (filling)
+            filling->set(i, found, neighbours, &k_distances[0]);
+
+         // the smallest cosine is that of the largest angle
+         float min_bisec_cos = 1;
+         bisec_cos[i] = min_bisec_cos;
+         for (int j = 1; j < cols; j++) {
+            if (j < found)
+               min_bisec_cos = std::min(min_bisec_cos, ma_bisec[neighbours[j]].dot(ma_bisec[i]));
+            bisec_cos[j * N + i] = min_bisec_cos;
          }
       }
-
-#ifdef VERBOSEPRINT
-      elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-      std::cout << "Cleaned MA points in " << elapsed_time.count() << " ms" << std::endl;
-      start_time = Clock::now();
-#endif
+      balance.finish();
    }
+   if (filling)
+      filling->finish();
+   timer.stop();
 
-   // We can't produce LFS values if there are no MAT points
-   if (count == 0)
-      return false;
+   if (madata.stats) {
+      balance.report(madata.stats.get(), "lfs/bisector_angles");
+      madata.stats->count("lfs/kd_tree_queries", cached ? 0 : N);
+   }
+}
 
-   // mask and copy pointlist ma_coords
-   PointCloud::Ptr ma_coords_masked(new PointCloud);
-   ma_coords_masked->reserve(count);
+size_t clean_ma_points(ma_data &madata, size_t N, double bisec_threshold, int bisec_k, std::vector<char> &bisec_mask)
+{
+   if (!bisec_cos_covers(madata, N, bisec_k))
+      compute_bisec_cos(madata, N, bisec_k);
+
+   // The angle between two bisectors is below the threshold if the cosine of the angle, their dot product, is
+   // above the cosine of the threshold. Any angle is below a threshold of 180 degrees or more.
+   float min_cos = bisec_threshold < M_PI ? float(std::cos(bisec_threshold)) : -2;
+   const float *bisec_cos = &madata.ma_bisec_cos[(std::max(bisec_k, 1) - 1) * N];
+
+   bisec_mask.resize(N);
+   long long count = 0;
+#pragma omp parallel for schedule(static) reduction(+:count)
+   for (long long i = 0; i < (long long)N; i++) {
+      bisec_mask[i] = bisec_cos[i] > min_cos;
+      count += bisec_mask[i];
+   }
+   return size_t(count);
+}
 
-   for (int i = 0; i < N; i++) {
-      if (bisec_mask[i])
-         ma_coords_masked->push_back((*madata.ma_coords)[i]);
+bool compute_lfs(ma_data &madata, double bisec_threshold, int bisec_k, bool only_inner)
+{
+   size_t N = 2 * madata.coords->size();
+   if (only_inner) {
+      N = madata.coords->size();
+      (*madata.ma_coords).resize(N); // HACK this will destroy permanently the exterior ma_coords!
    }
-#ifdef VERBOSEPRINT
-   elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-   std::cout << "Copied cleaned MA points in " << elapsed_time.count() << " ms" << std::endl;
-   start_time = Clock::now();
-#endif
+   // compute bisector and filter .. rebuild kdtree .. compute lfs .. compute grid .. thin each cell
 
-   {
-      // rebuild kd-tree
-      pcl::search::KdTree<Point>::Ptr kd_tree(new pcl::search::KdTree<Point>());
-      kd_tree->setInputCloud(ma_coords_masked);
-#ifdef VERBOSEPRINT
-      elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-      std::cout << "Constructed cleaned kd-tree in " << elapsed_time.count() << " ms" << std::endl;
-      start_time = Clock::now();
-#endif
+   std::vector<char> bisec_mask;
+   size_t count = clean_ma_points(madata, N, bisec_threshold, bisec_k, bisec_mask);
 
-      // Results from our search
-      std::vector<int> k_indices(1);
-      std::vector<Scalar> k_distances(1);
+   // We can't produce LFS values if there are no (cleaned) MAT points
+   if (count == 0)
+      return false;
 
-#pragma omp parallel for private(k_indices, k_distances)
-      for (int i = 0; i < madata.coords->size(); i++) {
-         kd_tree->nearestKSearch((*madata.coords)[i], 1, k_indices, k_distances); // find closest point to c
+   stats_sink *stats = madata.stats.get();
+   if (stats)
+      stats->count("lfs/cleaned_ma_points", count);
+   stage_timer timer(stats, "lfs/copy_cleaned");
+   // mask and copy pointlist ma_coords, every kept point goes to its rank among the kept points
+   point_array::Ptr ma_coords_masked(new point_array(count));
+   parallel_scan(N,
+      [&bisec_mask](size_t i) { return int64_t(bisec_mask[i]); },
+      [&](size_t i, int64_t rank) {
+         if (bisec_mask[i])
+            ma_coords_masked->set(rank, madata.ma_coords->x[i], madata.ma_coords->y[i], madata.ma_coords->z[i]);
+      });
 
-         madata.lfs[i] = std::sqrt(k_distances[0]);
+   {
+      // rebuild kd-tree
+      timer.next("lfs/cleaned_kd_tree");
+      kdtree kd_tree(ma_coords_masked);
+      timer.next("lfs/nearest");
+
+      load_balance balance;
+#pragma omp parallel
+      {
+         balance.start();
+#pragma omp for schedule(dynamic, dynamic_chunk_size) nowait
+         for (int i = 0; i < int(madata.coords->size()); i++) {
+            Scalar k_distance;
+            kd_tree.nearest((*madata.coords)[i], k_distance); // find closest point to c
+
+            madata.lfs[i] = std::sqrt(k_distance);
+         }
+         balance.finish();
+      }
+      timer.stop();
+      if (stats) {
+         balance.report(stats, "lfs/nearest");
+         stats->count("lfs/kd_tree_queries", madata.coords->size());
       }
-#ifdef VERBOSEPRINT
-      elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-      std::cout << "Computed LFS in " << elapsed_time.count() << " ms" << std::endl;
-      start_time = Clock::now();
-#endif
    }
 
    return true;
 }
 
-inline size_t flatindex(size_t ind[], size_t size[], bool true_z_dim) {
+inline uint64_t flatindex(size_t ind[], size_t size[], bool true_z_dim) {
    if (!true_z_dim)
       return ind[0] + size[0] * ind[1];
    return ind[0] + size[0] * (ind[1] + ind[2] * size[1]);
 }
 
-void simplify(ma_data &madata, 
-             double cellsize, 
-             double epsilon, 
-             bool true_z_dim = true, 
-             double elevation_threshold = 0.0, 
-             double minimum_density = 0,
-             double maximum_density = 0,
-             bool squared = false) 
+// The points of the occupied cells of the simplification grid, in compressed sparse row layout. The points of
+// cell c are points[offsets[c]] .. points[offsets[c + 1] - 1] in increasing order, and the cells are in the
+// order of their flat index. Empty cells take no memory, and non-finite points are not in any cell.
+struct simplify_grid {
+   std::vector<int64_t> offsets;
+   std::vector<int> points;
+   std::vector<double> mean_lfs; // after squaring and the elevation jump rule, so it only depends on the grid
+
+   size_t size() const { return mean_lfs.size(); }
+};
+
+simplify_grid populate_grid(ma_data &madata,
+                            double cellsize,
+                            bool true_z_dim,
+                            double elevation_threshold,
+                            bool squared)
 {
-#ifdef VERBOSEPRINT
-   auto start_time = Clock::now();
-#endif
+   stage_timer timer(madata.stats.get(), "simplify/grid");
+
+   // bounding box of the finite points
+   const point_array &coords = *madata.coords;
+   int N = int(coords.size());
+   Vector3 minPt = Vector3::Constant(std::numeric_limits<Scalar>::max());
+   Vector3 maxPt = Vector3::Constant(-std::numeric_limits<Scalar>::max());
+#pragma omp parallel
+   {
+      Vector3 thread_min = minPt, thread_max = maxPt;
+#pragma omp for schedule(static) nowait
+      for (int i = 0; i < N; i++) {
+         if (!coords.is_finite(i)) continue;
+         thread_min = thread_min.cwiseMin(coords[i]);
+         thread_max = thread_max.cwiseMax(coords[i]);
+      }
+#pragma omp critical
+      {
+         minPt = minPt.cwiseMin(thread_min);
+         maxPt = maxPt.cwiseMax(thread_max);
+      }
+   }
+   // Without finite points the extent is undefined. The grid is empty then, and thin_grid keeps no points.
+   if (!(minPt[0] <= maxPt[0])) {
+      simplify_grid grid;
+      grid.offsets.assign(1, 0);
+      return grid;
+   }
 
-   Point minPt;
-   Point maxPt;
-   pcl::getMinMax3D(*(madata.coords), minPt, maxPt);
    float size[3];
-   size[0] = maxPt.x - minPt.x;
-   size[1] = maxPt.y - minPt.y;
+   size[0] = maxPt[0] - minPt[0];
+   size[1] = maxPt[1] - minPt[1];
    if (true_z_dim)
-      size[2] = maxPt.z - minPt.z;
-   Point origin = minPt;
-
-   size_t* resolution = new size_t[3];
-
-   #ifdef VERBOSEPRINT
-   std::cout << "Epsilon: " << epsilon << std::endl;
-   std::cout << "Maximum density: " << maximum_density << std::endl;
-   std::cout << "Minimum density: " << minimum_density << std::endl;
-   std::cout << "True z: " << true_z_dim << std::endl;
-   std::cout << "Squared: " << squared << std::endl;
-   std::cout << "Cellsize: " << cellsize << std::endl;
-   std::cout << "Data dimensions: " << size[0] << " x " << size[1];
-   if (true_z_dim) std::cout << " x " << size[2];
-   std::cout << std::endl;
-   std::cout << "Grid dimension: ";
-   #endif
-
-   // x, y, z - resolution
-   resolution[0] = size_t(size[0] / cellsize) + 1;
-   resolution[1] = size_t(size[1] / cellsize) + 1;
-   if (true_z_dim)
-      resolution[2] = size_t(size[2] / cellsize) + 1;
-
-   #ifdef VERBOSEPRINT
-   std::cout << resolution[0] << " ";
-   std::cout << resolution[1] << " ";
-   if (true_z_dim)
-      std::cout << resolution[2] << " ";
-   std::cout << std::endl;
-   #endif
+      size[2] = maxPt[2] - minPt[2];
+   Vector3 origin = minPt;
+
+   size_t resolution[3];
+
+   // x, y, z - resolution. Only the occupied cells are stored, but the flat index of a cell has to fit in 64 bits
+   int dims = true_z_dim ? 3 : 2;
+   double total_cells = 1;
+   for (int d = 0; d < dims; d++) {
+      double cells = std::floor(size[d] / cellsize) + 1;
+      total_cells *= cells;
+      if (!(total_cells < 1.8e19)) {
+         std::cerr << "Cellsize " << cellsize << " is too small for the extent of the points" << std::endl;
+         exit(1);
+      }
+      resolution[d] = size_t(cells);
+   }
 
-   size_t ncells = 1;
+   uint64_t ncells = 1;
    ncells *= resolution[0];
    ncells *= resolution[1];
    if (true_z_dim)
       ncells *= resolution[2];
-
-   intList** grid = new intList*[ncells];
-   for (size_t i = 0; i < ncells; i++) {
-      grid[i] = NULL;
-   }
-
-   size_t* idx = new size_t[3];
-   size_t index;
-   for (int i = 0; i < madata.coords->size(); i++) {
-      idx[0] = size_t(((*madata.coords)[i].x - origin.x) / cellsize);
-      idx[1] = size_t(((*madata.coords)[i].y - origin.y) / cellsize);
+   int key_bits = 0;
+   while (key_bits < 64 && (ncells - 1) >> key_bits)
+      key_bits++;
+
+   // The (cell, point) pairs of the finite points, sorted by cell. The sort is stable, so the points of a
+   // cell stay in increasing order, and its memory use does not depend on the number of (empty) cells.
+   simplify_grid grid;
+   auto finite = [&coords](size_t i) { return int64_t(coords.is_finite(i)); };
+   int64_t nfinite = 0;
+#pragma omp parallel for schedule(static) reduction(+:nfinite)
+   for (int i = 0; i < N; i++)
+      nfinite += finite(i);
+   std::vector<uint64_t> keys(nfinite);
+   grid.points.resize(nfinite);
+   parallel_scan(N, finite, [&](size_t i, int64_t rank) {
+      if (!coords.is_finite(i))
+         return;
+      size_t idx[3];
+      idx[0] = size_t((coords.x[i] - origin[0]) / cellsize);
+      idx[1] = size_t((coords.y[i] - origin[1]) / cellsize);
       if (true_z_dim)
-         idx[2] = size_t(((*madata.coords)[i].z - origin.z) / cellsize);
-
-      index = flatindex(idx, resolution, true_z_dim);
-
-      if (grid[index] == NULL) {
-         intList *ilist = new intList;
-         // std::unique_ptr<intList> ilist(new intList);
-         grid[index] = ilist;
+         idx[2] = size_t((coords.z[i] - origin[2]) / cellsize);
+      keys[rank] = flatindex(idx, resolution, true_z_dim);
+      grid.points[rank] = int(i);
+   });
+   parallel_radix_sort(keys, grid.points, key_bits);
+
+   // a cell starts at every change of the key
+   auto cell_start = [&keys](size_t k) { return int64_t(k == 0 || keys[k] != keys[k - 1]); };
+   int64_t nonempty = 0;
+#pragma omp parallel for schedule(static) reduction(+:nonempty)
+   for (int64_t k = 0; k < nfinite; k++)
+      nonempty += cell_start(k);
+   grid.offsets.resize(nonempty + 1);
+   grid.offsets[nonempty] = nfinite;
+   parallel_scan(nfinite, cell_start, [&](size_t k, int64_t rank) {
+      if (cell_start(k))
+         grid.offsets[rank] = k;
+   });
+   std::vector<uint64_t>().swap(keys);
+
+   grid.mean_lfs.resize(nonempty);
+#pragma omp parallel for schedule(dynamic, dynamic_chunk_size)
+   for (int64_t c = 0; c < nonempty; c++) {
+      const int *begin = &grid.points[0] + grid.offsets[c], *end = &grid.points[0] + grid.offsets[c + 1];
+
+      size_t n = end - begin;
+      float sum = 0, max_z, min_z;
+      max_z = min_z = coords.z[*begin];
+
+      for (const int *j = begin; j != end; j++) {
+         sum += madata.lfs[*j];
+         float z = coords.z[*j];
+         if (z > max_z) max_z = z;
+         if (z < min_z) min_z = z;
       }
-      (*grid[index]).push_back(i);
-   }
 
-   delete[] resolution; resolution = NULL;
-   delete[] idx; idx = NULL;
+      double mean_lfs = sum / n;
 
-#ifdef VERBOSEPRINT
-   auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-   std::cout << "Populated grid in " << elapsed_time.count() << " ms" << std::endl;
-   start_time = Clock::now();
-#endif
+      if (squared) mean_lfs = pow(mean_lfs, 2);
+      if (elevation_threshold != 0 && (max_z - min_z) > elevation_threshold)
+         mean_lfs /= 10;
+         // mean_lfs = 0.01;
+      grid.mean_lfs[c] = mean_lfs;
+   }
 
-   double mean_lfs, target_n, A = cellsize*cellsize;
+   timer.stop();
+   if (madata.stats)
+      madata.stats->count("simplify/occupied_cells", nonempty);
+   return grid;
+}
 
+// The seed of the random thinning
+inline uint64_t thinning_seed() {
 #ifdef DETERMINISTIC_RNG
-   std::mt19937 gen;
+   return 0;
 #else
    std::random_device rd;
-   std::mt19937 gen(rd());
+   return (uint64_t(rd()) << 32) | rd();
 #endif
-   std::uniform_real_distribution<float> randu(0, 1);
+}
+
+// Counter-based uniform random number in [0, 1): the draw for a point only depends on the seed and the
+// (input) index of the point, not on the order in which the points are visited or by which thread.
+// The splitmix64 finalizer mixes the bits of the counter.
+inline float uniform_draw(uint64_t seed, uint64_t counter) {
+   uint64_t z = seed + (counter + 1) * 0x9E3779B97F4A7C15ull;
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+   z ^= z >> 31;
+   return float(z >> 40) * (1.0f / 16777216.0f);
+}
 
+// Keep a random subset of the points of every cell, of the size that the lfs of the cell asks for.
+// set(i, keep) records the decision for point i, it is called from several threads at once if parallel
+// is set. Returns the number of points that are kept.
+template <typename SetMask>
+size_t thin_grid(const simplify_grid &grid,
+                 const std::vector<int> &order,
+                 double cellsize,
+                 double epsilon,
+                 double minimum_density,
+                 double maximum_density,
+                 uint64_t seed,
+                 bool parallel,
+                 SetMask set)
+{
+   double A = cellsize*cellsize;
    double target_n_max = maximum_density * A;
    double target_n_min = minimum_density * A;
-   // parallelize?
-   for (int i = 0; i < ncells; i++)
-      if (grid[i] != NULL) {
-         size_t n = grid[i]->size();
-         float sum = 0, max_z, min_z;
-         max_z = min_z = (*madata.coords)[(*grid[i])[0]].z;
-
-         for (auto j : *grid[i]) {
-            sum += madata.lfs[j];
-            float z = (*madata.coords)[j].z;
-            if (z > max_z) max_z = z;
-            if (z < min_z) min_z = z;
-         }
-
-         mean_lfs = sum / n;
-
-         if (squared) mean_lfs = pow(mean_lfs, 2);
-         if (elevation_threshold != 0 && (max_z - min_z) > elevation_threshold)
-            mean_lfs /= 10;
-            // mean_lfs = 0.01;
-
-         target_n = A / pow(epsilon*mean_lfs, 2);
-         if(target_n_max != 0 && target_n > target_n_max) target_n = target_n_max;
-         else if(target_n_min != 0 && target_n < target_n_min) target_n = target_n_min;
-         for (auto j : *grid[i])
-            madata.mask[j] = randu(gen) <= target_n / n;
+   int64_t kept = 0;
+#pragma omp parallel for if(parallel) schedule(dynamic, dynamic_chunk_size) reduction(+:kept)
+   for (int64_t c = 0; c < int64_t(grid.size()); c++) {
+      size_t n = grid.offsets[c + 1] - grid.offsets[c];
+      double target_n = A / pow(epsilon*grid.mean_lfs[c], 2);
+      if(target_n_max != 0 && target_n > target_n_max) target_n = target_n_max;
+      else if(target_n_min != 0 && target_n < target_n_min) target_n = target_n_min;
+      for (int64_t k = grid.offsets[c]; k < grid.offsets[c + 1]; k++) {
+         int j = grid.points[k];
+         bool keep = uniform_draw(seed, order.empty() ? j : order[j]) <= target_n / n;
+         set(j, keep);
+         kept += keep;
       }
-#ifdef VERBOSEPRINT
-   elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time);
-   std::cout << "Performed grid simplification in " << elapsed_time.count() << " ms" << std::endl;
-   start_time = Clock::now();
-#endif
-
-
-   // clear some memory in non-smart ptr way
-   for (int i = 0; i < ncells; i++) {
-      delete grid[i];
    }
-   delete[] grid;
+   return size_t(kept);
+}
 
+void simplify(ma_data &madata, 
+             double cellsize, 
+             double epsilon, 
+             bool true_z_dim = true, 
+             double elevation_threshold = 0.0, 
+             double minimum_density = 0,
+             double maximum_density = 0,
+             bool squared = false) 
+{
+   simplify_grid grid = populate_grid(madata, cellsize, true_z_dim, elevation_threshold, squared);
+
+   stage_timer timer(madata.stats.get(), "simplify/thin");
+   size_t kept = thin_grid(grid, madata.order, cellsize, epsilon, minimum_density, maximum_density, thinning_seed(), true,
+      [&madata](int i, bool keep) { madata.mask[i] = keep; });
+   timer.stop();
+   if (madata.stats)
+      madata.stats->count("simplify/kept_points", kept);
 }
 
 void simplify_lfs(simplify_parameters &input_parameters, ma_data& madata)
@@ -358,11 +465,58 @@ void simplify_lfs(simplify_parameters &input_parameters, ma_data& madata)
                     input_parameters.squared);
 }
 
+bool simplify_sweep(simplify_parameters &input_parameters,
+                    const std::vector<sweep_parameters> &sweep,
+                    ma_data &madata,
+                    std::vector<std::vector<bool> > &masks,
+                    std::vector<size_t> &counts)
+{
+   masks.assign(sweep.size(), std::vector<bool>());
+   counts.assign(sweep.size(), 0);
+   if (input_parameters.compute_lfs)
+   {
+      if (!compute_lfs(madata, input_parameters.bisec_threshold, input_parameters.bisec_k, input_parameters.only_inner))
+         return false;
+   }
+
+   // the settings with the same cellsize share a grid, the grids are populated one at a time
+   std::vector<double> cellsizes;
+   for (const sweep_parameters &s : sweep)
+      cellsizes.push_back(s.cellsize);
+   std::sort(cellsizes.begin(), cellsizes.end());
+   cellsizes.erase(std::unique(cellsizes.begin(), cellsizes.end()), cellsizes.end());
+
+   // all settings draw the same random numbers, so for the same cellsize and density bounds a smaller
+   // epsilon keeps a superset of the points
+   uint64_t seed = thinning_seed();
+   for (double cellsize : cellsizes) {
+      simplify_grid grid = populate_grid(madata, cellsize, input_parameters.true_z_dim,
+                                                   input_parameters.elevation_threshold, input_parameters.squared);
+      std::vector<int> settings;
+      for (size_t t = 0; t < sweep.size(); t++)
+         if (sweep[t].cellsize == cellsize)
+            settings.push_back(int(t));
+
+      stage_timer timer(madata.stats.get(), "simplify/thin");
+#pragma omp parallel for schedule(dynamic, 1)
+      for (int s = 0; s < int(settings.size()); s++) {
+         int t = settings[s];
+         std::vector<bool> &mask = masks[t];
+         mask.assign(madata.coords->size(), false);
+         // the bits of a mask are set by one thread only, so the settings are parallel and not the cells
+         counts[t] = thin_grid(grid, madata.order, cellsize, sweep[t].epsilon, sweep[t].minimum_density,
+            sweep[t].maximum_density, seed, false, [&mask](int i, bool keep) { mask[i] = keep; });
+      }
+   }
+   return true;
+}
+
 void simplify(normals_parameters &normals_params,
               ma_parameters &ma_params,
               simplify_parameters &simplify_params,
-              PointCloud::Ptr coords, bool *mask,  // mask *must* be allocated ahead of time to be an array of size "coords.size()".
-              progress_callback callback)
+              point_array::Ptr coords, bool *mask,  // mask *must* be allocated ahead of time to be an array of size "coords.size()".
+              progress_callback callback,
+              stats_sink::Ptr stats)
 {
    if (!coords || coords->size() == 0)
       return;
@@ -371,20 +525,22 @@ void simplify(normals_parameters &normals_params,
    // Step 0: prepare data struct:
    ma_data madata = {};
    madata.coords = coords; // add to the reference count
+   madata.stats = stats;
 
    ///////////////////////////
    // Step 1: compute normals:
-   NormalCloud::Ptr normals(new NormalCloud);
+   point_array::Ptr normals(new point_array);
    normals->resize(madata.coords->size());
    madata.normals = normals; // add to the reference count
    compute_normals(normals_params, madata);
 
    ///////////////////////////
    // Step 2: compute ma
-   PointCloud::Ptr ma_coords(new PointCloud);
+   point_array::Ptr ma_coords(new point_array);
    ma_coords->resize(2*madata.coords->size());
    madata.ma_coords = ma_coords; // add to the reference count
    madata.ma_qidx.resize(2 * madata.coords->size());
+   madata.ma_radius.resize(2 * madata.coords->size());
    compute_masb_points(ma_params, madata, callback);
 
    ///////////////////////////
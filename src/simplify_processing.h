@@ -23,6 +23,8 @@ SOFTWARE.
 #ifndef SIMPLIFY_PROCESSING_
 #define SIMPLIFY_PROCESSING_
 
+#include <vector>
+
 #include "types.h"
 #include "compute_normals_processing.h"
 #include "compute_ma_processing.h"
@@ -41,16 +43,51 @@ struct simplify_parameters {
    bool compute_lfs;
 };
 
+// One setting of the thinning that is evaluated by simplify_sweep
+struct sweep_parameters {
+   double epsilon;
+   double cellsize;
+   double minimum_density;
+   double maximum_density;
+};
+
+
+// The bisector cleaning of the LFS computation, for the first n MA points: bisec_mask[i] is set for the MA
+// points with a ball whose bisector makes an angle below bisec_threshold with the bisectors of their
+// bisec_k - 1 nearest MA points. The angles are taken from madata.ma_bisec_cos if that covers n and bisec_k,
+// and computed into it otherwise, with the neighbours taken from (or stored in) madata.ma_knn if that is set.
+// Returns the number of MA points that are kept.
+size_t clean_ma_points(ma_data &madata, size_t n, double bisec_threshold, int bisec_k, std::vector<char> &bisec_mask);
+
+// Whether madata.ma_bisec_cos holds the bisector angles of the first n MA points for bisec_k
+bool bisec_cos_covers(const ma_data &madata, size_t n, int bisec_k);
+
+// Computes madata.lfs, the distance of every point to the nearest MA point that passes the bisector cleaning
+// (of the inner MA points only if only_inner is set). The bisector angles are kept in madata, so computing the
+// lfs again for another bisec_threshold, or a smaller bisec_k, only builds a kd-tree of the cleaned MA points
+// and queries it. Returns false if no MA point passes the cleaning.
+bool compute_lfs(ma_data &madata, double bisec_threshold, int bisec_k, bool only_inner);
 
 // This version of simplify takes in an already calculated ma, etc.
 void simplify_lfs(simplify_parameters &input_parameters, ma_data& madata);
 
-// This version of simplify takes in only the coords of the original point cloud.
+// Computes the lfs once (unless compute_lfs is false) and thins the points for every setting of sweep,
+// instead of epsilon, cellsize and the density bounds of input_parameters. masks[t] and counts[t] are the
+// mask and the number of retained points of sweep[t]. Returns false if no lfs could be computed.
+bool simplify_sweep(simplify_parameters &input_parameters,
+                    const std::vector<sweep_parameters> &sweep,
+                    ma_data &madata,
+                    std::vector<std::vector<bool> > &masks,
+                    std::vector<size_t> &counts);
+
+// This version of simplify takes in only the coords of the original point cloud. The stages report to stats,
+// if that is set.
 void simplify(normals_parameters &normals_params, 
               ma_parameters &ma_params, 
               simplify_parameters &simplify_params,
-              PointCloud::Ptr coords,
+              point_array::Ptr coords,
               bool *mask, // mask *must* be allocated ahead of time to be an array of size "coords.size()".
-              progress_callback callback);
+              progress_callback callback,
+              stats_sink::Ptr stats = stats_sink::Ptr());
 
 #endif
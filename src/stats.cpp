@@ -0,0 +1,140 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#elif !defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+size_t peak_rss() {
+#if defined(_WIN32)
+   PROCESS_MEMORY_COUNTERS counters;
+   if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+      return 0;
+   return counters.PeakWorkingSetSize;
+#elif defined(__linux__)
+   std::ifstream status("/proc/self/status");
+   std::string line;
+   while (std::getline(status, line))
+      if (line.compare(0, 6, "VmHWM:") == 0)
+         return size_t(std::strtoull(line.c_str() + 6, NULL, 10)) * 1024;
+   return 0;
+#else
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   return size_t(usage.ru_maxrss); // in bytes on macOS
+#endif
+}
+
+void stats_recorder::stage(const std::string &name, double seconds, size_t peak_rss) {
+   std::lock_guard<std::mutex> lock(mutex_);
+   auto inserted = stages_.insert(std::make_pair(name, stage_total{0, 0, 0}));
+   if (inserted.second)
+      stage_order_.push_back(name);
+   stage_total &total = inserted.first->second;
+   total.seconds += seconds;
+   total.runs++;
+   total.peak_rss = std::max(total.peak_rss, peak_rss);
+   if (echo_)
+      *echo_ << name << ": " << long(1000 * seconds) << " ms" << std::endl;
+}
+
+void stats_recorder::count(const std::string &name, uint64_t value) {
+   std::lock_guard<std::mutex> lock(mutex_);
+   counters_[name] += value;
+   if (echo_)
+      *echo_ << name << ": " << value << std::endl;
+}
+
+void stats_recorder::value(const std::string &name, double value) {
+   std::lock_guard<std::mutex> lock(mutex_);
+   values_[name] = value;
+   if (echo_)
+      *echo_ << name << ": " << value << std::endl;
+}
+
+void stats_recorder::histogram(const std::string &name, const std::vector<uint64_t> &bins) {
+   std::lock_guard<std::mutex> lock(mutex_);
+   std::vector<uint64_t> &total = histograms_[name];
+   if (total.size() < bins.size())
+      total.resize(bins.size());
+   for (size_t i = 0; i < bins.size(); i++)
+      total[i] += bins[i];
+   if (echo_) {
+      *echo_ << name << ":";
+      for (size_t i = 0; i < bins.size(); i++)
+         *echo_ << " " << bins[i];
+      *echo_ << std::endl;
+   }
+}
+
+void stats_recorder::write_json(std::ostream &out) const {
+   // the names are fixed identifiers of the library, they need no escaping
+   std::lock_guard<std::mutex> lock(mutex_);
+   out.precision(9);
+   out << "{\n  \"stages\": {";
+   for (size_t i = 0; i < stage_order_.size(); i++) {
+      const stage_total &total = stages_.find(stage_order_[i])->second;
+      out << (i ? ",\n" : "\n") << "    \"" << stage_order_[i] << "\": {\"seconds\": " << total.seconds
+          << ", \"runs\": " << total.runs << ", \"peak_rss_bytes\": " << total.peak_rss << "}";
+   }
+   out << "\n  },\n  \"counters\": {";
+   const char *separator = "\n";
+   for (auto &c : counters_) {
+      out << separator << "    \"" << c.first << "\": " << c.second;
+      separator = ",\n";
+   }
+   out << "\n  },\n  \"values\": {";
+   separator = "\n";
+   for (auto &v : values_) {
+      out << separator << "    \"" << v.first << "\": " << v.second;
+      separator = ",\n";
+   }
+   out << "\n  },\n  \"histograms\": {";
+   separator = "\n";
+   for (auto &h : histograms_) {
+      out << separator << "    \"" << h.first << "\": [";
+      for (size_t i = 0; i < h.second.size(); i++)
+         out << (i ? ", " : "") << h.second[i];
+      out << "]";
+      separator = ",\n";
+   }
+   out << "\n  }\n}\n";
+}
+
+void stats_recorder::write_json(std::string path) const {
+   std::ofstream out(path);
+   if (!out) {
+      std::cerr << "Invalid file path " << path << std::endl;
+      exit(1);
+   }
+   write_json(out);
+}
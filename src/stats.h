@@ -0,0 +1,127 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_STATS_
+#define MASBCPP_STATS_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Receiver of the measurements of the processing functions: the durations of their stages, and counters
+// such as the number of kd-tree queries or the bytes read and written. The functions report to the sink in
+// ma_data::stats, without one they measure nothing. Names are paths, like "ma/shrink" or "io/bytes_read".
+// The methods may be called from several threads at once.
+class stats_sink {
+public:
+   typedef std::shared_ptr<stats_sink> Ptr;
+
+   virtual ~stats_sink() {}
+
+   // A stage took seconds of wall clock time, after which the peak resident set size of the process was
+   // peak_rss bytes (0 if unknown). A stage that runs several times (per tile, per cellsize) is reported
+   // every time.
+   virtual void stage(const std::string &name, double seconds, size_t peak_rss) = 0;
+
+   // Adds value to a counter
+   virtual void count(const std::string &name, uint64_t value) = 0;
+
+   // Sets a measured value that is not a count, such as the efficiency of a parallel loop
+   virtual void value(const std::string &name, double value) = 0;
+
+   // Adds bins[i] to bin i of a histogram
+   virtual void histogram(const std::string &name, const std::vector<uint64_t> &bins) = 0;
+};
+
+// Peak resident set size of the process in bytes, 0 where it is not known
+size_t peak_rss();
+
+// Reports the time from its construction, or from the last next(), to the next call of next() or stop(), or
+// to its destruction, as a stage of sink. Without a sink (null) it does not even read the clock.
+class stage_timer {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+   stage_timer(stats_sink *sink, const char *name) : sink_(sink), name_(name) {
+      if (sink_)
+         start_ = Clock::now();
+   }
+   ~stage_timer() { stop(); }
+
+   void next(const char *name) {
+      stop();
+      name_ = name;
+      if (sink_)
+         start_ = Clock::now();
+   }
+
+   void stop() {
+      if (sink_ && name_)
+         sink_->stage(name_, std::chrono::duration<double>(Clock::now() - start_).count(), peak_rss());
+      name_ = nullptr;
+   }
+
+private:
+   stats_sink *sink_;
+   const char *name_;
+   Clock::time_point start_;
+};
+
+// A sink that keeps everything, to write it as JSON at the end of a run. The runs of a stage are summed,
+// with their number and the largest peak resident set size. If echo is set, everything is also printed to
+// it as it comes in, which is the progress output of the command line tools.
+class stats_recorder : public stats_sink {
+public:
+   explicit stats_recorder(std::ostream *echo = nullptr) : echo_(echo) {}
+
+   void stage(const std::string &name, double seconds, size_t peak_rss);
+   void count(const std::string &name, uint64_t value);
+   void value(const std::string &name, double value);
+   void histogram(const std::string &name, const std::vector<uint64_t> &bins);
+
+   // {"stages": {name: {"seconds", "runs", "peak_rss_bytes"}}, "counters": {...}, "values": {...},
+   //  "histograms": {name: [bins]}}, with the stages in the order in which they first finished
+   void write_json(std::ostream &out) const;
+   void write_json(std::string path) const;
+
+private:
+   struct stage_total {
+      double seconds;
+      size_t runs;
+      size_t peak_rss;
+   };
+
+   mutable std::mutex mutex_;
+   std::ostream *echo_;
+   std::vector<std::string> stage_order_;
+   std::map<std::string, stage_total> stages_;
+   std::map<std::string, uint64_t> counters_;
+   std::map<std::string, double> values_;
+   std::map<std::string, std::vector<uint64_t> > histograms_;
+};
+
+#endif
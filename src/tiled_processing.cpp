@@ -0,0 +1,530 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "tiled_processing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "io.h"
+#include "pipeline_processing.h"
+
+//==============================
+//   TILED COMPUTE MA
+//==============================
+
+// Estimate of the memory needed per loaded point: coords, normals, interior and exterior
+// MA points, q indices and radii, the kd-tree and the bookkeeping of the tile. The pages of the
+// mapped input are released every npy_copy_rows rows, so they are not counted per point.
+const size_t bytes_per_point = 128;
+// Resolution of the density grid that is used to choose the tile size
+const int density_grid_size = 256;
+// Rows per chunk when the points are bucketed by tile, small so that the chunk stays well below the memory budget
+const size_t bucket_chunk_rows = 1 << 16;
+
+struct density_grid {
+   Scalar min_x, min_y, max_x, max_y;
+   Scalar cellsize;
+   int nx, ny;
+   std::vector<size_t> sums; // (nx + 1) x (ny + 1) summed area table of the point counts
+
+   void cell(const float *p, int &ix, int &iy) const {
+      // points with non-finite coordinates are put in the first cell
+      ix = iy = 0;
+      if (finite_bits(p[0]) && finite_bits(p[1]) && finite_bits(p[2])) {
+         ix = std::min(int((p[0] - min_x) / cellsize), nx - 1);
+         iy = std::min(int((p[1] - min_y) / cellsize), ny - 1);
+      }
+   }
+
+   size_t count(int x0, int y0, int x1, int y1) const {
+      // number of points in the cells [x0, x1) x [y0, y1), clipped to the grid
+      x0 = std::max(x0, 0); y0 = std::max(y0, 0);
+      x1 = std::min(x1, nx); y1 = std::min(y1, ny);
+      if (x0 >= x1 || y0 >= y1)
+         return 0;
+      return sums[x1 * (ny + 1) + y1] - sums[x0 * (ny + 1) + y1] - sums[x1 * (ny + 1) + y0] + sums[x0 * (ny + 1) + y0];
+   }
+};
+
+density_grid compute_density_grid(const npy_map &coords_map) {
+   const float *coords = npy_rows<float>(coords_map);
+
+   // bounding box in the xy plane
+   density_grid grid;
+   grid.min_x = grid.min_y = std::numeric_limits<Scalar>::max();
+   grid.max_x = grid.max_y = -std::numeric_limits<Scalar>::max();
+   // Every pass releases the pages of the rows it has read, so the mapped file does not stay resident
+   for (size_t first = 0; first < coords_map.rows; first += npy_copy_rows) {
+      size_t count = std::min(npy_copy_rows, coords_map.rows - first);
+      for (size_t i = first; i < first + count; i++) {
+         const float *p = &coords[3 * i];
+         if (!(finite_bits(p[0]) && finite_bits(p[1]) && finite_bits(p[2]))) continue;
+         grid.min_x = std::min(grid.min_x, p[0]); grid.max_x = std::max(grid.max_x, p[0]);
+         grid.min_y = std::min(grid.min_y, p[1]); grid.max_y = std::max(grid.max_y, p[1]);
+      }
+      npy_release(coords_map, first, count);
+   }
+   if (grid.min_x > grid.max_x)
+      grid.min_x = grid.max_x = grid.min_y = grid.max_y = 0;
+
+   Scalar extent = std::max(grid.max_x - grid.min_x, grid.max_y - grid.min_y);
+   grid.cellsize = extent > 0 ? extent / density_grid_size : 1;
+   grid.nx = std::max(1, std::min(density_grid_size, int(std::ceil((grid.max_x - grid.min_x) / grid.cellsize))));
+   grid.ny = std::max(1, std::min(density_grid_size, int(std::ceil((grid.max_y - grid.min_y) / grid.cellsize))));
+
+   // point counts per cell, then the summed area table
+   std::vector<size_t> counts(grid.nx * grid.ny, 0);
+   for (size_t first = 0; first < coords_map.rows; first += npy_copy_rows) {
+      size_t count = std::min(npy_copy_rows, coords_map.rows - first);
+      for (size_t i = first; i < first + count; i++) {
+         int ix, iy;
+         grid.cell(&coords[3 * i], ix, iy);
+         counts[ix * grid.ny + iy]++;
+      }
+      npy_release(coords_map, first, count);
+   }
+   grid.sums.assign((grid.nx + 1) * (grid.ny + 1), 0);
+   for (int x = 0; x < grid.nx; x++)
+      for (int y = 0; y < grid.ny; y++)
+         grid.sums[(x + 1) * (grid.ny + 1) + y + 1] = counts[x * grid.ny + y]
+            + grid.sums[x * (grid.ny + 1) + y + 1] + grid.sums[(x + 1) * (grid.ny + 1) + y] - grid.sums[x * (grid.ny + 1) + y];
+   return grid;
+}
+
+// The points bucketed by tile, so a tile only reads the points of its own cells and those of its halo. Every
+// point has a key with its cell (x * ny + y) in the upper and its index in the lower 32 bits. The keys are kept
+// in a temporary file that is mapped while the tiles are processed, so they are not all resident; the keys of
+// tile t are the rows offsets[t] up to offsets[t + 1], in increasing order of the point index.
+struct tile_buckets {
+   std::string path;
+   std::vector<size_t> offsets;
+   npy_map map;
+
+   static uint64_t key(int cell, size_t i) { return uint64_t(cell) << 32 | uint64_t(i); }
+   static int cell(uint64_t key) { return int(key >> 32); }
+   static int index(uint64_t key) { return int(key & 0xffffffffu); }
+};
+
+tile_buckets bucket_by_tile(const npy_map &coords_map, const density_grid &grid, int tile_size, std::string path) {
+   const float *coords = npy_rows<float>(coords_map);
+   int tiles_x = (grid.nx + tile_size - 1) / tile_size, tiles_y = (grid.ny + tile_size - 1) / tile_size;
+   int n_tiles = tiles_x * tiles_y;
+
+   // the size of the buckets follows from the density grid
+   tile_buckets buckets;
+   buckets.path = path;
+   buckets.offsets.assign(n_tiles + 1, 0);
+   for (int tx = 0; tx < tiles_x; tx++)
+      for (int ty = 0; ty < tiles_y; ty++)
+         buckets.offsets[tx * tiles_y + ty + 1] = grid.count(tx * tile_size, ty * tile_size, (tx + 1) * tile_size, (ty + 1) * tile_size);
+   for (int t = 0; t < n_tiles; t++)
+      buckets.offsets[t + 1] += buckets.offsets[t];
+
+   // Counting sort of every chunk of the input by tile, the runs of each tile are appended to its bucket
+   auto tile = [&](uint64_t key) {
+      int c = tile_buckets::cell(key);
+      return c / grid.ny / tile_size * tiles_y + c % grid.ny / tile_size;
+   };
+   npy_file file = npy_create<uint64_t>(path, coords_map.rows, 1);
+   std::vector<size_t> next(buckets.offsets.begin(), buckets.offsets.end() - 1);
+   std::vector<uint64_t> chunk_keys(std::min(bucket_chunk_rows, coords_map.rows)), sorted_keys(chunk_keys.size());
+   std::vector<size_t> chunk_offsets(n_tiles + 1);
+   for (size_t first = 0; first < coords_map.rows; first += bucket_chunk_rows) {
+      size_t count = std::min(bucket_chunk_rows, coords_map.rows - first);
+      std::fill(chunk_offsets.begin(), chunk_offsets.end(), 0);
+      for (size_t k = 0; k < count; k++) {
+         int ix, iy;
+         grid.cell(&coords[3 * (first + k)], ix, iy);
+         chunk_keys[k] = tile_buckets::key(ix * grid.ny + iy, first + k);
+         chunk_offsets[tile(chunk_keys[k]) + 1]++;
+      }
+      npy_release(coords_map, first, count);
+
+      for (int t = 0; t < n_tiles; t++)
+         chunk_offsets[t + 1] += chunk_offsets[t];
+      std::vector<size_t> at(chunk_offsets.begin(), chunk_offsets.end() - 1);
+      for (size_t k = 0; k < count; k++)
+         sorted_keys[at[tile(chunk_keys[k])]++] = chunk_keys[k];
+      for (int t = 0; t < n_tiles; t++) {
+         size_t n = chunk_offsets[t + 1] - chunk_offsets[t];
+         if (n == 0) continue;
+         npy_write_rows(file, next[t], n, &sorted_keys[chunk_offsets[t]]);
+         next[t] += n;
+      }
+   }
+   npy_close(file);
+   buckets.map = npy_mmap(path);
+   return buckets;
+}
+
+size_t max_tile_points(const density_grid &grid, int t, int halo_cells) {
+   size_t max_points = 0;
+   for (int tx = 0; tx * t < grid.nx; tx++)
+      for (int ty = 0; ty * t < grid.ny; ty++)
+         max_points = std::max(max_points, grid.count(tx * t - halo_cells, ty * t - halo_cells, (tx + 1) * t + halo_cells, (ty + 1) * t + halo_cells));
+   return max_points;
+}
+
+int choose_tile_size(const density_grid &grid, double halo, size_t budget_points, size_t &max_points) {
+   // Largest tile size (in grid cells) for which no tile plus its halo holds more than budget_points
+   int halo_cells = int(std::ceil(halo / grid.cellsize));
+   for (int t = std::max(grid.nx, grid.ny); t >= 1; t--) {
+      max_points = max_tile_points(grid, t, halo_cells);
+      if (max_points <= budget_points)
+         return t;
+   }
+   // The halo alone is too large, smaller tiles would only add work. Fall back to the largest
+   // tiles whose interior fits in the budget.
+   int t = std::max(grid.nx, grid.ny);
+   while (t > 1 && max_tile_points(grid, t, 0) > budget_points)
+      t--;
+   max_points = max_tile_points(grid, t, halo_cells);
+   return t;
+}
+
+template <typename T>
+void write_interior_rows(npy_file &file, const std::vector<size_t> &global_idx, const std::vector<T> &rows, size_t cols) {
+   // The global indices are increasing, write the rows in runs of consecutive indices
+   size_t begin = 0;
+   for (size_t i = 1; i <= global_idx.size(); i++) {
+      if (i == global_idx.size() || global_idx[i] != global_idx[i - 1] + 1) {
+         npy_write_rows(file, global_idx[begin], i - begin, &rows[begin * cols]);
+         begin = i;
+      }
+   }
+}
+
+void compute_masb_points_tiled(tiling_parameters &tiling_params,
+                               normals_parameters &normals_params,
+                               ma_parameters &ma_params,
+                               std::string input_dir_path,
+                               std::string output_dir_path,
+                               stats_sink::Ptr stats)
+{
+   stage_timer timer(stats.get(), "tiled/total");
+
+   // The inputs are mapped, every pass over the tiles reads them straight from the page cache
+   npy_map coords_map = npy_mmap(input_dir_path + "/coords.npy");
+   if (coords_map.word_size != sizeof(float) || coords_map.cols != 3) {
+      std::cerr << "Unexpected array type or shape in coords.npy" << std::endl;
+      exit(1);
+   }
+   npy_map normals_map = {};
+   if (!tiling_params.compute_normals) {
+      normals_map = npy_mmap(input_dir_path + "/normals.npy");
+      if (normals_map.word_size != sizeof(float) || normals_map.cols != 3 || normals_map.rows != coords_map.rows) {
+         std::cerr << "Mismatched number of coords and normals" << std::endl;
+         exit(1);
+      }
+   }
+   size_t N = coords_map.rows;
+   // the q indices are written as int32 and the buckets keep 32 bit point indices
+   if (N > size_t(std::numeric_limits<int>::max())) {
+      std::cerr << "Too many points (" << N << "), at most " << std::numeric_limits<int>::max() << " are supported" << std::endl;
+      exit(1);
+   }
+   const float *coords = npy_rows<float>(coords_map);
+   const float *normals_in = npy_rows<float>(normals_map);
+
+   double halo = tiling_params.halo > 0 ? tiling_params.halo : 2.0 * ma_params.initial_radius;
+   density_grid grid = compute_density_grid(coords_map);
+
+   size_t budget_points = size_t(tiling_params.memory_budget / bytes_per_point);
+   size_t max_points;
+   int tile_size = choose_tile_size(grid, halo, budget_points, max_points);
+   int tiles_x = (grid.nx + tile_size - 1) / tile_size, tiles_y = (grid.ny + tile_size - 1) / tile_size;
+
+   std::cout << "Tiling: " << tiles_x << " x " << tiles_y << " tiles of " << tile_size * grid.cellsize << " units, halo " << halo
+      << ", at most " << max_points << " points per tile" << std::endl;
+   if (max_points > budget_points)
+      std::cout << "Warning: the halo alone holds more points than the memory budget allows, the budget will be exceeded" << std::endl;
+
+   tile_buckets buckets = bucket_by_tile(coords_map, grid, tile_size, output_dir_path + "/tile_buckets.npy");
+   const uint64_t *keys = npy_rows<uint64_t>(buckets.map);
+
+   npy_file ma_coords_in = npy_create<float>(output_dir_path + "/ma_coords_in.npy", N, 3);
+   npy_file ma_coords_out = npy_create<float>(output_dir_path + "/ma_coords_out.npy", N, 3);
+   npy_file ma_qidx_in = npy_create<int>(output_dir_path + "/ma_qidx_in.npy", N, 1);
+   npy_file ma_qidx_out = npy_create<int>(output_dir_path + "/ma_qidx_out.npy", N, 1);
+   npy_file ma_radius_in = npy_create<float>(output_dir_path + "/ma_radius_in.npy", N, 1);
+   npy_file ma_radius_out = npy_create<float>(output_dir_path + "/ma_radius_out.npy", N, 1);
+   npy_file normals_out = {};
+   if (tiling_params.compute_normals)
+      normals_out = npy_create<float>(output_dir_path + "/normals.npy", N, 3);
+   npy_file termination_in = {}, termination_out = {};
+   if (tiling_params.termination) {
+      termination_in = npy_create<uint8_t>(output_dir_path + "/ma_termination_in.npy", N, 1);
+      termination_out = npy_create<uint8_t>(output_dir_path + "/ma_termination_out.npy", N, 1);
+   }
+
+   size_t uncertified = 0, uncertified_normals = 0;
+   double needed_halo = 2.0 * ma_params.initial_radius;
+   std::vector<int> knn_indices(normals_params.k + 1);
+   std::vector<Scalar> knn_sqdists(normals_params.k + 1);
+   for (int tx = 0; tx < tiles_x; tx++) {
+      for (int ty = 0; ty < tiles_y; ty++) {
+         int cx0 = tx * tile_size, cy0 = ty * tile_size;
+         int cx1 = std::min(cx0 + tile_size, grid.nx), cy1 = std::min(cy0 + tile_size, grid.ny);
+         if (grid.count(cx0, cy0, cx1, cy1) == 0)
+            continue;
+
+         // extent of the loaded region, tile plus halo
+         Scalar x0 = Scalar(grid.min_x + cx0 * grid.cellsize - halo), x1 = Scalar(grid.min_x + cx1 * grid.cellsize + halo);
+         Scalar y0 = Scalar(grid.min_y + cy0 * grid.cellsize - halo), y1 = Scalar(grid.min_y + cy1 * grid.cellsize + halo);
+
+         // Gather the points of the tile and its halo
+         ma_data madata = {};
+         madata.stats = stats;
+         madata.coords.reset(new point_array);
+         if (!tiling_params.compute_normals)
+            madata.normals.reset(new point_array);
+         std::vector<size_t> global_idx;
+         std::vector<int> interior;
+
+         // The cells that overlap the loaded region. cell() is monotonic in x and y, so the points within
+         // the region lie in the cells of its corners or between them.
+         int hx0, hy0, hx1, hy1;
+         Scalar corner0[3] = {x0, y0, 0}, corner1[3] = {x1, y1, 0};
+         grid.cell(corner0, hx0, hy0);
+         grid.cell(corner1, hx1, hy1);
+         if (x0 < grid.min_x) hx0 = 0;
+         if (y0 < grid.min_y) hy0 = 0;
+
+         // Take the points of those cells from the buckets of their tiles, in input order, so the tile is the
+         // same as when all points are scanned
+         std::vector<int> candidates;
+         for (int ux = hx0 / tile_size; ux <= hx1 / tile_size; ux++) {
+            for (int uy = hy0 / tile_size; uy <= hy1 / tile_size; uy++) {
+               size_t begin = buckets.offsets[ux * tiles_y + uy], end = buckets.offsets[ux * tiles_y + uy + 1];
+               for (size_t k = begin; k < end; k++) {
+                  int c = tile_buckets::cell(keys[k]);
+                  int ix = c / grid.ny, iy = c % grid.ny;
+                  if (ix >= hx0 && ix <= hx1 && iy >= hy0 && iy <= hy1)
+                     candidates.push_back(tile_buckets::index(keys[k]));
+               }
+               npy_release(buckets.map, begin, end - begin);
+            }
+         }
+         std::sort(candidates.begin(), candidates.end());
+
+         size_t released = 0;
+         for (size_t c = 0; c < candidates.size(); c++) {
+            size_t i = size_t(candidates[c]);
+            // release the pages of the rows that are behind, in whole chunks
+            if (i - released >= npy_copy_rows) {
+               size_t chunk = i / npy_copy_rows * npy_copy_rows;
+               npy_release(coords_map, released, chunk - released);
+               if (!tiling_params.compute_normals)
+                  npy_release(normals_map, released, chunk - released);
+               released = chunk;
+            }
+
+            const float *p = &coords[3 * i];
+            int ix, iy;
+            grid.cell(p, ix, iy);
+            bool inside = ix >= cx0 && ix < cx1 && iy >= cy0 && iy < cy1;
+            if (!inside && !(p[0] >= x0 && p[0] <= x1 && p[1] >= y0 && p[1] <= y1))
+               continue;
+
+            if (inside)
+               interior.push_back(int(global_idx.size()));
+            global_idx.push_back(i);
+            madata.coords->push_back(p[0], p[1], p[2]);
+            if (!tiling_params.compute_normals)
+               madata.normals->push_back(normals_in[3 * i], normals_in[3 * i + 1], normals_in[3 * i + 2]);
+         }
+         npy_release(coords_map, released, N - released);
+         if (!tiling_params.compute_normals)
+            npy_release(normals_map, released, N - released);
+
+         std::cout << "Tile " << tx * tiles_y + ty + 1 << "/" << tiles_x * tiles_y << ": " << interior.size() << " points, "
+            << global_idx.size() - interior.size() << " halo points" << std::endl;
+
+         // Process the tile
+         if (tiling_params.spatial_sort) {
+            sort_spatially(madata);
+            // follow the points to their sorted positions, interior_global below stays increasing
+            std::vector<int> inverse = inverse_order(madata.order);
+            std::vector<size_t> sorted_idx(global_idx.size());
+            for (size_t s = 0; s < sorted_idx.size(); s++)
+               sorted_idx[s] = global_idx[madata.order[s]];
+            global_idx.swap(sorted_idx);
+            for (size_t k = 0; k < interior.size(); k++)
+               interior[k] = inverse[interior[k]];
+         }
+         size_t n = madata.coords->size();
+         if (tiling_params.termination)
+            madata.ma_termination.resize(2 * n);
+         if (tiling_params.compute_normals) {
+            compute_normals_and_masb_points(normals_params, ma_params, madata);
+         } else {
+            madata.ma_coords.reset(new point_array);
+            madata.ma_coords->resize(2 * n);
+            madata.ma_qidx.resize(2 * n);
+            madata.ma_radius.resize(2 * n);
+            compute_masb_points(ma_params, madata);
+         }
+
+         // Write the results of the interior points
+         size_t m = interior.size();
+         std::vector<size_t> interior_global(m);
+         std::vector<float> coords_in(3 * m), coords_out(3 * m), radius_in(m), radius_out(m), normals;
+         std::vector<int> qidx_in(m), qidx_out(m);
+         std::vector<uint8_t> termination_rows_in, termination_rows_out;
+         if (tiling_params.compute_normals)
+            normals.resize(3 * m);
+         if (tiling_params.termination) {
+            termination_rows_in.resize(m);
+            termination_rows_out.resize(m);
+         }
+
+         for (size_t k = 0; k < m; k++) {
+            int i = interior[k];
+            interior_global[k] = global_idx[i];
+            for (int d = 0; d < 3; d++) {
+               coords_in[3 * k + d] = madata.ma_coords->dim(d)[i];
+               coords_out[3 * k + d] = madata.ma_coords->dim(d)[i + n];
+            }
+            qidx_in[k] = madata.ma_qidx[i] == -1 ? -1 : int(global_idx[madata.ma_qidx[i]]);
+            qidx_out[k] = madata.ma_qidx[i + n] == -1 ? -1 : int(global_idx[madata.ma_qidx[i + n]]);
+            radius_in[k] = madata.ma_radius[i];
+            radius_out[k] = madata.ma_radius[i + n];
+            if (tiling_params.compute_normals) {
+               normals[3 * k + 0] = madata.normals->x[i];
+               normals[3 * k + 1] = madata.normals->y[i];
+               normals[3 * k + 2] = madata.normals->z[i];
+            }
+            if (tiling_params.termination) {
+               termination_rows_in[k] = madata.ma_termination[i];
+               termination_rows_out[k] = madata.ma_termination[i + n];
+            }
+
+            // A ball of radius r touching p lies within 2r of p. If that is inside the loaded region
+            // (or the region extends beyond the data), no missing point can change the ball.
+            Scalar px = madata.coords->x[i], py = madata.coords->y[i];
+            Scalar margin = std::numeric_limits<Scalar>::max();
+            if (x0 > grid.min_x) margin = std::min(margin, px - x0);
+            if (x1 < grid.max_x) margin = std::min(margin, x1 - px);
+            if (y0 > grid.min_y) margin = std::min(margin, py - y0);
+            if (y1 < grid.max_y) margin = std::min(margin, y1 - py);
+
+            // The same holds for a normal whose k nearest neighbours are all within the margin. Its balls
+            // depend on it, so they are not certified either if it isn't.
+            bool normal_certified = true;
+            if (tiling_params.compute_normals) {
+               int neighbours = normals_params.k + 1;
+               int found = madata.kd_tree->nearest_k((*madata.coords)[i], neighbours, knn_indices.data(), knn_sqdists.data());
+               // with fewer points the missing neighbours can only be outside the region, if there is data there
+               double kth = found == neighbours ? std::sqrt(double(knn_sqdists[neighbours - 1])) : double(std::numeric_limits<Scalar>::max());
+               if (kth > margin) {
+                  normal_certified = false;
+                  uncertified_normals++;
+                  needed_halo = std::max(needed_halo, kth);
+               }
+            }
+            for (int side = 0; side < 2; side++) {
+               double r = madata.ma_radius[i + side * n];
+               if (!finite_bits(r))
+                  r = ma_params.initial_radius;
+               if (!normal_certified || 2 * r > margin)
+                  uncertified++;
+            }
+         }
+
+         write_interior_rows(ma_coords_in, interior_global, coords_in, 3);
+         write_interior_rows(ma_coords_out, interior_global, coords_out, 3);
+         write_interior_rows(ma_qidx_in, interior_global, qidx_in, 1);
+         write_interior_rows(ma_qidx_out, interior_global, qidx_out, 1);
+         write_interior_rows(ma_radius_in, interior_global, radius_in, 1);
+         write_interior_rows(ma_radius_out, interior_global, radius_out, 1);
+         if (tiling_params.compute_normals)
+            write_interior_rows(normals_out, interior_global, normals, 3);
+         if (tiling_params.termination) {
+            write_interior_rows(termination_in, interior_global, termination_rows_in, 1);
+            write_interior_rows(termination_out, interior_global, termination_rows_out, 1);
+         }
+      }
+   }
+
+   if (uncertified_normals)
+      std::cout << "Warning: " << uncertified_normals << " normals have neighbours outside the halo and may differ from an in-core computation" << std::endl;
+   if (uncertified)
+      std::cout << "Warning: " << uncertified << " balls may differ from an in-core computation, increase the halo to at least "
+         << needed_halo << " to avoid this" << std::endl;
+
+   npy_unmap(buckets.map);
+   std::remove(buckets.path.c_str());
+
+   size_t bytes_read = npy_unmap(coords_map), bytes_written = 0;
+   if (!tiling_params.compute_normals)
+      bytes_read += npy_unmap(normals_map);
+   else
+      bytes_written += npy_close(normals_out);
+   bytes_written += npy_close(ma_coords_in) + npy_close(ma_coords_out);
+   bytes_written += npy_close(ma_qidx_in) + npy_close(ma_qidx_out);
+   bytes_written += npy_close(ma_radius_in) + npy_close(ma_radius_out);
+   if (tiling_params.termination)
+      bytes_written += npy_close(termination_in) + npy_close(termination_out);
+
+   timer.stop();
+   if (stats) {
+      // the inputs are mapped once and read from the page cache by every tile
+      stats->count("io/bytes_read", bytes_read);
+      stats->count("io/bytes_written", bytes_written);
+      stats->count("tiled/uncertified_balls", uncertified);
+      stats->count("tiled/uncertified_normals", uncertified_normals);
+   }
+}
+
+size_t compare_ma_tiled(ma_parameters &ma_params, std::string input_dir_path, std::string output_dir_path, stats_sink::Ptr stats) {
+   // the results of the tiled run, next to the input points they belong to
+   ma_data tiled = {};
+   tiled.stats = stats;
+   io_parameters io_params = {};
+   io_params.coords = true;
+   npy2madata(input_dir_path, tiled, io_params);
+   io_params.coords = false;
+   io_params.ma_coords = true;
+   io_params.ma_qidx = true;
+   io_params.ma_radius = true;
+   npy2madata(output_dir_path, tiled, io_params);
+
+   ma_data madata = {};
+   madata.stats = stats;
+   io_params = {};
+   io_params.coords = true;
+   io_params.normals = true;
+   npy2madata(input_dir_path, madata, io_params);
+   madata.ma_coords.reset(new point_array);
+   madata.ma_coords->resize(2 * madata.coords->size());
+   madata.ma_qidx.resize(2 * madata.coords->size());
+   madata.ma_radius.resize(2 * madata.coords->size());
+   compute_masb_points(ma_params, madata);
+
+   return count_ma_mismatches(*tiled.ma_coords, tiled.ma_qidx, tiled.ma_radius, madata);
+}
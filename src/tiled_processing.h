@@ -0,0 +1,59 @@
+/*
+Copyright (c) 2016 Ravi Peters
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MASBCPP_TILED_PROCESSING_
+#define MASBCPP_TILED_PROCESSING_
+
+#include <string>
+
+#include "compute_ma_processing.h"
+#include "compute_normals_processing.h"
+
+struct tiling_parameters {
+   double memory_budget; // in bytes, the tiles are chosen so that one tile plus its halo fits in this budget
+   double halo;          // width of the halo around each tile, 0 means twice the initial radius
+   bool compute_normals; // estimate normals per tile instead of reading them from normals.npy
+   bool spatial_sort;    // process the points of each tile in Morton order
+   bool termination;     // also write ma_termination_in.npy and ma_termination_out.npy, see compute_masb_points
+};
+
+// Out-of-core version of compute_normals + compute_masb_points. The input is split into square tiles
+// in the xy plane. Each tile is loaded together with the points in a halo around it, and the results
+// of the points inside the tile are written straight into the output .npy files. With the default halo
+// of twice the initial radius, every ball that can touch a point of the tile is inside the loaded region.
+// The points of a tile keep their input order and the kd-tree breaks ties on that order, so with the
+// normals read from normals.npy, without warm starting and without spatial sorting, the results are
+// bit-for-bit the same as for the in-core computation (see compare_ma_tiled). Warm starting and sorting
+// visit the points in another order per tile, which changes a few balls as it does in-core. The stages of
+// every tile report to stats, if that is set.
+void compute_masb_points_tiled(tiling_parameters &tiling_params,
+                               normals_parameters &normals_params,
+                               ma_parameters &ma_params,
+                               std::string input_dir_path,
+                               std::string output_dir_path,
+                               stats_sink::Ptr stats = stats_sink::Ptr());
+
+// Computes the MAT of the input in-core and returns the number of balls whose results differ (bitwise) from
+// the ones that compute_masb_points_tiled wrote to output_dir_path with the same ma_params.
+size_t compare_ma_tiled(ma_parameters &ma_params, std::string input_dir_path, std::string output_dir_path, stats_sink::Ptr stats = stats_sink::Ptr());
+
+#endif
@@ -23,6 +23,8 @@ SOFTWARE.
 #ifndef MASBCPP_TYPES_
 #define MASBCPP_TYPES_
 
+#include <cstdint>
+#include <cstring>
 #include <vector>
 
 #include <Eigen/Core>
@@ -39,6 +41,24 @@ typedef Eigen::Matrix<bool, Eigen::Dynamic, 1> ArrayXb; // Type for 1D bool arra
 
 typedef std::vector<int> intList; // Type for ints
 
+// Finiteness tests on the bit pattern (the exponent bits are not all ones). The project is built with -ffast-math,
+// under which the compiler may fold std::isfinite and Eigen's allFinite to true.
+inline bool finite_bits(float v) {
+   uint32_t bits;
+   std::memcpy(&bits, &v, sizeof(bits));
+   return (bits & 0x7f800000u) != 0x7f800000u;
+}
+
+inline bool finite_bits(double v) {
+   uint64_t bits;
+   std::memcpy(&bits, &v, sizeof(bits));
+   return (bits & 0x7ff0000000000000ull) != 0x7ff0000000000000ull;
+}
+
+inline bool finite_bits(const Vector3 &v) {
+   return finite_bits(v[0]) && finite_bits(v[1]) && finite_bits(v[2]);
+}
+
 typedef pcl::PointXYZ Point;
 typedef pcl::Normal Normal;
 typedef pcl::PointCloud<Point> PointCloud;